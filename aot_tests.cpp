@@ -0,0 +1,35 @@
+// Runs a program compiled by rvm-aot and the interpreter side by side, see
+// the rvm aot tests in meson.build
+
+#include "rvm.hpp"
+#include <iostream>
+
+rvm::Code aot_program_code();
+rvm::Status aot_program(rvm::VM& vm);
+
+int main() {
+    rvm::VM interpreted{aot_program_code()};
+    rvm::VM compiled{aot_program_code()};
+    auto expected = interpreted.run();
+    auto status = aot_program(compiled);
+
+    if (status.kind != expected.kind || compiled.pc != interpreted.pc) {
+        std::cerr << "FAIL: compiled program ended with " << status.what() << " at " << compiled.pc
+                  << ", the interpreter with " << expected.what() << " at " << interpreted.pc << std::endl;
+        return 1;
+    }
+    if (compiled.stack.size() != interpreted.stack.size()) {
+        std::cerr << "FAIL: compiled program left " << compiled.stack.size() << " values, the interpreter "
+                  << interpreted.stack.size() << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < compiled.stack.size(); i++) {
+        if (!compiled.stack[i].same(interpreted.stack[i])) {
+            std::cerr << "FAIL: stack[" << i << "] is " << compiled.stack[i].string() << ", the interpreter left "
+                      << interpreted.stack[i].string() << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "compiled program matches the interpreter, " << compiled.stack.size() << " values" << std::endl;
+    return 0;
+}
@@ -1,42 +1,136 @@
 #include "rvm.hpp"
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <format>
 #include <iostream>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 int main(int argc, char **argv) {
     std::vector<char*> args = std::vector<char*>(argv, argv + argc);
 
-    if (args.size() < 2) {
+    bool optimize = false;
+    bool jit = false;
+    bool registers = false;
+    char *profile_path = nullptr;
+    char *perf_path = nullptr;
+    char *path = nullptr;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (std::string_view(args[i]) == "--optimize") {
+            optimize = true;
+        } else if (std::string_view(args[i]) == "--jit") {
+            jit = true;
+        } else if (std::string_view(args[i]) == "--registers") {
+            registers = true;
+        } else if (std::string_view(args[i]) == "--profile" && i + 1 < args.size()) {
+            profile_path = args[++i];
+        } else if (std::string_view(args[i]) == "--perf" && i + 1 < args.size()) {
+            perf_path = args[++i];
+        } else if (path == nullptr) {
+            path = args[i];
+        }
+    }
+
+    if (path == nullptr) {
         std::cerr << "ERROR: rvm requires at least 1 argument\n";
+        std::cerr << "usage: rvm [--optimize] [--jit] [--registers] [--profile <file.json|file.csv>] [--perf <file.folded>] <file>\n";
         return 1;
     }
 
-    FILE *file = fopen(args[1], "r");
-    defer(fclose(file));
+#if !RVM_PROFILE
+    if (profile_path != nullptr || perf_path != nullptr) {
+        std::cerr << "ERROR: rvm was built without profiling, configure it with -Dprofile=true\n";
+        return 1;
+    }
+#endif
 
     rvm::Error *error = nullptr;
     defer(if (error != nullptr) { delete error; });
-    auto bytecode = rvm::bytecode_from_file(file, &error);
+    auto code = rvm::code_from_file(path, &error);
 
     if (error != nullptr) {
         std::cerr << "ERROR: " << error->what();
         return 2;
     }
 
-    for (auto instruction : bytecode) {
-        std::cout << instruction.string() << "\n";
+    if (optimize) {
+        std::vector<rvm::Instruction> bytecode{};
+        for (rvm::u64 pc = 0; pc < code.size(); pc++) {
+            bytecode.push_back(code.instruction(pc));
+        }
+        rvm::optimize(bytecode);
+        code = rvm::Code(bytecode);
+    }
+
+    for (rvm::u64 pc = 0; pc < code.size(); pc++) {
+        std::cout << code.instruction(pc).string() << "\n";
+    }
+
+    rvm::Program program{std::move(code)};
+    if (jit) {
+        program.edit().compile();
+    }
+
+    rvm::VM vm{program};
+    if (registers) {
+        vm.select(rvm::Engine::Register);
+    }
+
+    rvm::PerfSampler sampler{};
+    if (perf_path != nullptr) {
+        sampler.start(vm, &error);
+        if (error != nullptr) {
+            std::cerr << "ERROR: " << error->what() << std::endl;
+            return 2;
+        }
+    }
+
+    auto status = vm.run();
+    sampler.stop();
+    if (status.kind == rvm::StatusKind::Error) {
+        std::cerr << "ERROR: " << status.what() << std::endl;
+    }
+
+    for (size_t i = 0; i < vm.stack.size(); i++) {
+        std::cout << vm.stack[i].string() << "\n";
     }
 
-    rvm::VM vm{bytecode};
+#if RVM_PROFILE
+    if (profile_path != nullptr) {
+        vm.profile.write_table(stderr, *vm.program);
 
-    while (error == nullptr) {
-        vm.tick(&error);
+        FILE *file = fopen(profile_path, "w");
+        if (file == nullptr) {
+            std::cerr << "ERROR: could not open " << profile_path << ": " << strerror(errno) << std::endl;
+            return 2;
+        }
+        if (std::string_view(profile_path).ends_with(".csv")) {
+            vm.profile.write_csv(file, *vm.program);
+        } else {
+            vm.profile.write_json(file, *vm.program);
+        }
+        fclose(file);
     }
 
-    std::cerr << "ERROR: " << error->what() << std::endl;;
+    if (perf_path != nullptr) {
+        for (auto event : sampler.events()) {
+            rvm::u64 samples = 0;
+            for (auto count : sampler.samples(event)) {
+                samples += count;
+            }
+            std::cerr << std::format("{:<24} {:>16} {:>10} samples\n", rvm::perf_event_string(event), sampler.total(event), samples);
+        }
 
-    for (auto s : vm.stack.c) {
-        std::cout << s.string() << "\n";
+        FILE *file = fopen(perf_path, "w");
+        if (file == nullptr) {
+            std::cerr << "ERROR: could not open " << perf_path << ": " << strerror(errno) << std::endl;
+            return 2;
+        }
+        sampler.write_folded(file, *vm.program);
+        fclose(file);
     }
-    return 1;
+#endif
+    return status.kind == rvm::StatusKind::Halt ? 0 : 1;
 }
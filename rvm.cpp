@@ -1,13 +1,16 @@
 #include "rvm.hpp"
+#include "rvm_internal.hpp"
+#include <algorithm>
 #include <cerrno>
 #include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <stdexcept>
+#include <limits>
+#include <memory>
 #include <tuple>
 #include <type_traits>
-#include <variant>
+#include <unordered_map>
 #include <vector>
 #include <format>
 
@@ -15,8 +18,9 @@ namespace rvm {
 
 char const* instruction_kind_string(const InstructionKind& kind) {
     switch(kind) {
-#define _X(kind, args) case InstructionKind::kind: return #kind;
+#define _X(kind, ...) case InstructionKind::kind: return #kind;
     INSTRUCTION_KIND
+    SUPERINSTRUCTION_KIND
 #undef _X
         default:
             return "INVALID INSTRUCTION KIND";
@@ -25,7 +29,7 @@ char const* instruction_kind_string(const InstructionKind& kind) {
 
 size_t instruction_argument_amount(const InstructionKind& kind) {
     switch(kind) {
-#define _X(kind, args) case InstructionKind::kind: return args;
+#define _X(kind, args, ...) case InstructionKind::kind: return args;
     INSTRUCTION_KIND
 #undef _X
         default:
@@ -33,7 +37,28 @@ size_t instruction_argument_amount(const InstructionKind& kind) {
     }
 }
 
-Object *object_from_file(FILE *file, Error **error);
+size_t instruction_pops(const InstructionKind& kind) {
+    switch(kind) {
+#define _X(kind, args, pops, pushes) case InstructionKind::kind: return pops;
+    INSTRUCTION_KIND
+#undef _X
+        default:
+            return 0;
+    }
+}
+
+size_t instruction_pushes(const InstructionKind& kind) {
+    switch(kind) {
+#define _X(kind, args, pops, pushes) case InstructionKind::kind: return pushes;
+    INSTRUCTION_KIND
+#undef _X
+        default:
+            return 0;
+    }
+}
+
+Object *object_from_file(FILE *file, ObjectArena *arena, Error **error);
+static std::vector<Instruction> bytecode_from_stream(FILE *file, ObjectArena *arena, Error **error);
 
 std::tuple<char const*, bool> error_concat(char const* prefix, char const* error_str) {
     size_t prefix_len = strlen(prefix);
@@ -52,44 +77,57 @@ std::string Instruction::string() {
     return std::format("{} {}", instruction_kind_string(kind), value != nullptr ? value->string() : "<no args>");
 }
 
-void Instruction::check(Error **error) {
+static Status error_status(ErrorKind error, InstructionKind instruction, u64 pc, u64 operand) {
+    return Status{StatusKind::Error, error, instruction, pc, operand};
+}
+
+Status validate_instruction(InstructionKind kind, Object const *value) {
+    u64 argument = static_cast<u64>(value != nullptr ? value->kind : ObjectKind::Last);
+
     switch(kind) {
         case InstructionKind::Jmp:
         case InstructionKind::JmpIf: {
-            if (value == nullptr) {
-                *error = new Error(ErrorKind::InvalidInstruction, strdup(std::format("{} requires an object as an argument, but found none", instruction_kind_string(kind)).c_str()), true);
-                return;
-            }
-            if (value->kind != ObjectKind::U64) {
-                *error = new Error(ErrorKind::InvalidInstruction, strdup(std::format("{} requires an object argument of type U64", instruction_kind_string(kind)).c_str()), true);
-                return;
+            if (value == nullptr || value->kind != ObjectKind::U64) {
+                return error_status(ErrorKind::InvalidInstruction, kind, 0, argument);
             }
-            value->check(error);
-            return;
+            return value->validate();
         }
         case InstructionKind::Push: {
             if (value == nullptr) {
-                *error = new Error(ErrorKind::InvalidInstruction, strdup(std::format("{} requires an object as an argument, but found none", instruction_kind_string(kind)).c_str()), true);
-                return;
+                return error_status(ErrorKind::InvalidInstruction, kind, 0, argument);
             }
-            value->check(error);
-            return;
+            return value->validate();
         }
         case InstructionKind::Nop:
         case InstructionKind::JmpO:
         case InstructionKind::JmpIfO:
         case InstructionKind::Add:
-        case InstructionKind::Sub: {
+        case InstructionKind::Sub:
+        case InstructionKind::Alloc:
+        case InstructionKind::Load:
+        case InstructionKind::Store: {
             if (value != nullptr) {
-                *error = new Error(ErrorKind::InvalidInstruction, strdup(std::format("{} does not allow an object argument", instruction_kind_string(kind)).c_str()), true);
+                return error_status(ErrorKind::InvalidInstruction, kind, 0, argument);
             }
-            return;
+            return Status{};
         }
         case InstructionKind::Last:
-            *error = new Error(ErrorKind::InvalidInstruction, strdup(std::format("invalid instruction kind {}", static_cast<std::underlying_type_t<InstructionKind>>(kind)).c_str()), true);
+        default:
+            return error_status(ErrorKind::InvalidInstruction, kind, 0, argument);
+    }
+}
+
+void check_instruction(InstructionKind kind, Object const *value, Error **error) {
+    Status status = validate_instruction(kind, value);
+    if (!status.ok()) {
+        *error = new Error(status);
     }
 }
 
+void Instruction::check(Error **error) {
+    check_instruction(kind, value, error);
+}
+
 Instruction::Instruction(InstructionKind kind) : kind(kind), value(nullptr) {}
 Instruction::Instruction(InstructionKind kind, Object *value) : kind(kind), value(value) {}
 
@@ -103,9 +141,13 @@ Instruction::Instruction(Instruction const& rhs) {
 }
 
 Instruction& Instruction::operator=(Instruction const& rhs) {
-    kind = rhs.kind; 
-    if (rhs.value) {
-        value = new Object(rhs.value->kind, rhs.value->data);
+    if (this != &rhs) {
+        kind = rhs.kind; 
+        if (value != nullptr && !borrowed) {
+            delete value;
+        }
+        borrowed = false;
+        value = rhs.value ? new Object(rhs.value->kind, rhs.value->data) : nullptr;
     }
 
     return *this;
@@ -113,6 +155,7 @@ Instruction& Instruction::operator=(Instruction const& rhs) {
 
 Instruction::Instruction(Instruction &&rhs) noexcept {
     kind = std::move(rhs.kind);
+    borrowed = rhs.borrowed;
     value = std::move(rhs.value);
     rhs.value = nullptr;
     rhs.kind = InstructionKind::Last; // Make it invalid
@@ -120,9 +163,11 @@ Instruction::Instruction(Instruction &&rhs) noexcept {
 
 Instruction& Instruction::operator=(Instruction &&rhs) {
     if (this != &rhs) {
-        if (value != nullptr) {
+        if (value != nullptr && !borrowed) {
             delete value;
         }
+        kind = rhs.kind;
+        borrowed = rhs.borrowed;
         value = std::move(rhs.value);
         rhs.value = nullptr;
         rhs.kind = InstructionKind::Last; // Make it invalid
@@ -171,7 +216,25 @@ bool Instruction::same(const Instruction& other) const {
 }
 
 Instruction::~Instruction() {
-    if (value != nullptr) delete value;
+    if (value != nullptr && !borrowed) delete value;
+}
+
+Object *ObjectArena::make(Object object) {
+    if (next == end) [[unlikely]] {
+        chunk_size = std::clamp(chunk_size * 2, first_chunk, max_chunk);
+        chunks.push_back(std::make_unique<Object[]>(chunk_size));
+        next = chunks.back().get();
+        end = next + chunk_size;
+    }
+    made++;
+    *next = object;
+    return next++;
+}
+
+Instruction ObjectArena::instruction(InstructionKind kind, Object value) {
+    Instruction instruction(kind, make(value));
+    instruction.borrowed = true;
+    return instruction;
 }
 
 char const* object_kind_string(const ObjectKind& kind) {
@@ -187,11 +250,11 @@ char const* object_kind_string(const ObjectKind& kind) {
 std::string Object::string() {
     switch (kind) {
     case ObjectKind::U64:
-        return std::format("U64 {}", std::get<u64>(data));
+        return std::format("U64 {}", data);
     case ObjectKind::Pointer:
-        return std::format("Pointer {}", std::get<u64>(data));
+        return std::format("Pointer {}", data);
     case ObjectKind::Bool:
-        return std::format("Bool {}", std::get<bool>(data));
+        return std::format("Bool {}", boolean());
     default:
         return "INVALID OBJECT KIND";
     }
@@ -203,14 +266,13 @@ void Object::write(FILE *file, Error **error) {
         goto write_error;
     }
 
-    if (std::holds_alternative<u64>(data)) {
-        auto data = std::get<u64>(this->data);
+    if (kind == ObjectKind::Bool) {
+        u8 data = boolean();
         write = fwrite(&data, sizeof data, 1, file);
         if (write != 1) {
             goto write_error;
         }
-    } else if(std::holds_alternative<bool>(data)) {
-        auto data = std::get<bool>(this->data);
+    } else {
         write = fwrite(&data, sizeof data, 1, file);
         if (write != 1) {
             goto write_error;
@@ -234,89 +296,130 @@ bool Object::operator==(const Object& other) const {
 }
 
 bool Object::same(const Object& other) const {
-    if (this == &other) return true;
-    if (this->kind != other.kind) return false;
-    if (this->data != other.data) return false;
-
-    return true;
-}
-
-template <class T>
-bool Object::holds(Error **error) {
-    if (!std::holds_alternative<T>(data)) {
-        *error = new Error(ErrorKind::InvalidObject, strdup(
-            std::format("invalid object data, expected {}, got {}",
-                        typeid(T).name(),
-                        // NOTE: Extract to function if used twice
-                        // https://stackoverflow.com/questions/53696720/get-currently-held-typeid-of-stdvariant-like-boostvariant-type
-                        std::visit([](auto&& x)->decltype(auto){return typeid(x);}, data).name()
-                        )
-            .c_str()
-        ), true);
-        return false;
-    }
-    return true;
+    return kind == other.kind && data == other.data;
 }
 
-void Object::check(Error **error) {
+Status Object::validate() const {
     switch (kind) {
         case ObjectKind::U64:
-        case ObjectKind::Pointer: {
-            holds<u64>(error);
-            break;
-        }
-        case ObjectKind::Bool: {
-            holds<bool>(error);
-            break;
-        }
+        case ObjectKind::Pointer:
+            return Status{};
+        case ObjectKind::Bool:
+            if (data > 1) {
+                return error_status(ErrorKind::InvalidObject, InstructionKind::Last, 0, static_cast<u64>(kind));
+            }
+            return Status{};
         default:
-        case ObjectKind::Last: {
-            *error = new Error(ErrorKind::InvalidObject, strdup(std::format("invalid object kind {}", static_cast<std::underlying_type_t<ObjectKind>>(kind)).c_str()), true);
-            return;
-        }
+        case ObjectKind::Last:
+            return error_status(ErrorKind::InvalidObject, InstructionKind::Last, 0, static_cast<u64>(kind));
     }
 }
 
-Object Object::apply_operator(Operator op, Object rhs, Error **error) {
-    if (!std::holds_alternative<u64>(data)) {
-        *error = new Error(ErrorKind::InvalidOperator, "operators not supported for Bool");
-        return Object();
+void Object::check(Error **error) const {
+    Status status = validate();
+    if (!status.ok()) {
+        *error = new Error(status);
     }
+}
 
-    if (!std::holds_alternative<u64>(rhs.data)) {
-        *error = new Error(ErrorKind::InvalidOperator, "operators not supported for Bool");
-        return Object();
+static inline u64 operator_kinds(Object const& lhs, Object const& rhs) {
+    return static_cast<u64>(lhs.kind) << 8 | static_cast<u64>(rhs.kind);
+}
+
+// Allocates the object of Alloc, the values left on the stack are the roots
+static inline Status heap_allocate(Heap& heap, u64 pc, Object size, std::span<Object> roots, Object *pointer) {
+    if (size.kind != ObjectKind::U64) {
+        return error_status(ErrorKind::InvalidInstructionArgument, InstructionKind::Alloc, pc, static_cast<u64>(ObjectKind::U64));
     }
+    if (size.data > Heap::max_object_size) {
+        return error_status(ErrorKind::OutOfMemory, InstructionKind::Alloc, pc, size.data);
+    }
+    *pointer = heap.allocate(size.data, roots);
+    if (pointer->kind == ObjectKind::Last) {
+        return error_status(ErrorKind::OutOfMemory, InstructionKind::Alloc, pc, size.data);
+    }
+    return Status{};
+}
 
-    if (kind != rhs.kind) {
-        *error = new Error(ErrorKind::InvalidOperator, "object are not of same type");
-        return Object();
+// Checks the operands of Load and Store
+static inline Status heap_check(Heap const& heap, InstructionKind kind, u64 pc, Object pointer, Object index) {
+    if (pointer.kind != ObjectKind::Pointer) {
+        return error_status(ErrorKind::InvalidInstructionArgument, kind, pc, static_cast<u64>(ObjectKind::Pointer));
+    }
+    if (index.kind != ObjectKind::U64) {
+        return error_status(ErrorKind::InvalidInstructionArgument, kind, pc, static_cast<u64>(ObjectKind::U64));
     }
+    if (!heap.contains(pointer)) {
+        return error_status(ErrorKind::InvalidPointer, kind, pc, pointer.data);
+    }
+    if (index.data >= heap.size(pointer)) {
+        return error_status(ErrorKind::OutOfBounds, kind, pc, index.data);
+    }
+    return Status{};
+}
 
-    u64 lhs_data = std::get<u64>(data);
-    u64 rhs_data = std::get<u64>(rhs.data);
+// Checks the operands of Store and writes value, which copies a heap shared
+// with a clone first
+static inline Status heap_store(Heap& heap, u64 pc, Object pointer, Object index, Object value) {
+    Status status = heap_check(heap, InstructionKind::Store, pc, pointer, index);
+    if (!status.ok()) {
+        return status;
+    }
+    if (!heap.store(pointer, index.data, value)) {
+        return error_status(ErrorKind::OutOfMemory, InstructionKind::Store, pc, heap.used());
+    }
+    return Status{};
+}
 
-    if (op == Operator::Sub) {
-        return Object(kind, lhs_data - rhs_data);
-    } else {
-        return Object(kind, lhs_data + rhs_data);
+Object Object::apply_operator(Operator op, Object rhs, Error **error) {
+    if (!operator_applicable(*this, rhs)) [[unlikely]] {
+        *error = new Error(error_status(ErrorKind::InvalidOperator, InstructionKind::Last, 0, operator_kinds(*this, rhs)));
+        return Object();
     }
+
+    return Object(kind, op == Operator::Sub ? data - rhs.data : data + rhs.data);
 }
 
-std::vector<Instruction> bytecode_from_file(std::string_view filename, Error **error) {
+static std::vector<Instruction> bytecode_from_path(std::string_view filename, ObjectArena *arena, Error **error) {
     FILE* file = fopen(filename.data(), "r");
     if (file == NULL) {
         *error = new Error(ErrorKind::FileNotFound, strerror(errno));
         return {};
     }
     defer(fclose(file));
-    return bytecode_from_file(file, error);
+    return bytecode_from_stream(file, arena, error);
 }
 
+std::vector<Instruction> bytecode_from_file(std::string_view filename, Error **error) {
+    return bytecode_from_path(filename, nullptr, error);
+}
+
+std::vector<Instruction> bytecode_from_file(std::string_view filename, ObjectArena& arena, Error **error) {
+    return bytecode_from_path(filename, &arena, error);
+}
 
 std::vector<Instruction> bytecode_from_file(FILE *file, Error **error) {
+    return bytecode_from_stream(file, nullptr, error);
+}
+
+std::vector<Instruction> bytecode_from_file(FILE *file, ObjectArena& arena, Error **error) {
+    return bytecode_from_stream(file, &arena, error);
+}
+
+// Operands are allocated in arena, or with new if arena is nullptr
+static std::vector<Instruction> bytecode_from_stream(FILE *file, ObjectArena *arena, Error **error) {
     std::vector<Instruction> instructions = {};
 
+    // The container magic number starts with 'R', which is not a valid
+    // instruction. The rest of it is checked by parse_container.
+    int first = getc(file);
+    if (first != EOF) {
+        ungetc(first, file);
+    }
+    if (first == 'R') {
+        return bytecode_from_container(file, arena, error);
+    }
+
     while(!feof(file) && !ferror(file)) {
         u8 read_instruction = 0;
         size_t read = fread(&read_instruction, sizeof read_instruction, 1, file);
@@ -337,11 +440,12 @@ std::vector<Instruction> bytecode_from_file(FILE *file, Error **error) {
             case InstructionKind::JmpIf:
             case InstructionKind::Push: {
                 // Read object
-                auto obj = object_from_file(file, error);
+                auto obj = object_from_file(file, arena, error);
                 if (*error != nullptr) {
                     return instructions;
                 }
                 instructions.push_back(Instruction(instruction, obj));
+                instructions.back().borrowed = arena != nullptr;
                 break;
             }
             case InstructionKind::Nop:
@@ -349,8 +453,16 @@ std::vector<Instruction> bytecode_from_file(FILE *file, Error **error) {
             case InstructionKind::JmpIfO:
             case InstructionKind::Add:
             case InstructionKind::Sub:
+            case InstructionKind::Alloc:
+            case InstructionKind::Load:
+            case InstructionKind::Store:
                 instructions.push_back(Instruction(instruction));
                 break;
+            // Rejected above, superinstructions are never written
+#define _X(kind, ...) case InstructionKind::kind:
+            SUPERINSTRUCTION_KIND
+#undef _X
+            case InstructionKind::LastSuperinstruction:
             case InstructionKind::Last:
                 break;
               break;
@@ -375,9 +487,11 @@ error:
     }
 }
 
-Object *object_from_file(FILE *file, Error **error) {
+// Allocates the object in arena, or with new if arena is nullptr
+Object *object_from_file(FILE *file, ObjectArena *arena, Error **error) {
     u8 read_object = 0;
     ObjectKind object_kind;
+    Object object;
     size_t read = fread(&read_object, sizeof read_object, 1, file);
     if (read != 1) {
         goto error;
@@ -389,7 +503,6 @@ Object *object_from_file(FILE *file, Error **error) {
     }
 
     object_kind = static_cast<ObjectKind>(read_object);
-    Object *object;
 
     switch (object_kind) {
         case ObjectKind::Pointer:
@@ -399,7 +512,7 @@ Object *object_from_file(FILE *file, Error **error) {
             if (read != 1) {
                 goto error;
             }
-            object = new Object(object_kind, obj_u64);
+            object = Object(object_kind, obj_u64);
             break;
         }
         case ObjectKind::Bool: {
@@ -408,7 +521,7 @@ Object *object_from_file(FILE *file, Error **error) {
             if (read != 1) {
                 goto error;
             }
-            object = new Object(object_kind, obj_bool != 0);
+            object = Object(object_kind, obj_bool != 0);
             break;
         }
         case ObjectKind::Last:
@@ -416,7 +529,7 @@ Object *object_from_file(FILE *file, Error **error) {
         }
 
     *error = nullptr;
-    return object;
+    return arena != nullptr ? arena->make(object) : new Object(object);
 
 error:
     if (feof(file)) {
@@ -435,12 +548,13 @@ error:
 //| |____| |  | | | (_) | |
 //|______|_|  |_|  \___/|_|
 
-Error::Error(ErrorKind kind) { Error(kind, "", false); }
+Error::Error(ErrorKind kind) : kind(kind) {}
 Error::Error(ErrorKind kind, char const *error_value, bool cleanup_error_value) : kind(kind), error_value(error_value), cleanup_error_value(cleanup_error_value) {}
 Error::Error(ErrorKind kind, std::tuple<char const*, bool> error_value) :
     kind(kind),
     error_value(std::get<char const*>(error_value)),
     cleanup_error_value(std::get<bool>(error_value)) {}
+Error::Error(Status status) : kind(status.error), status(status) {}
 
 Error::~Error() {
     if (cleanup_error_value) {
@@ -449,9 +563,72 @@ Error::~Error() {
 }
 
 char const* Error::what() {
+    if (status.kind == StatusKind::Error) {
+        if (message.empty()) {
+            message = status.what();
+        }
+        return message.c_str();
+    }
     return error_value;
 }
 
+std::string Status::what() const {
+    switch (kind) {
+        case StatusKind::Ok:
+            return "ok";
+        case StatusKind::Halt:
+            return std::format("halted. pc={}", pc);
+        case StatusKind::BudgetExhausted:
+            return std::format("budget exhausted. pc={}", pc);
+        case StatusKind::Error:
+            break;
+    }
+
+    switch (error) {
+        case ErrorKind::InvalidObject: {
+            auto object = static_cast<ObjectKind>(operand);
+            if (object >= ObjectKind::Last) {
+                return std::format("invalid object kind {}", operand);
+            }
+            return std::format("invalid object data for {}", object_kind_string(object));
+        }
+        case ErrorKind::InvalidInstruction: {
+            if (instruction >= InstructionKind::Last) {
+                return std::format("invalid instruction kind {}", static_cast<std::underlying_type_t<InstructionKind>>(instruction));
+            }
+            if (instruction_argument_amount(instruction) == 0) {
+                return std::format("{} does not allow an object argument", instruction_kind_string(instruction));
+            }
+            if (static_cast<ObjectKind>(operand) == ObjectKind::Last) {
+                return std::format("{} requires an object as an argument, but found none", instruction_kind_string(instruction));
+            }
+            return std::format("{} requires an object argument of type U64", instruction_kind_string(instruction));
+        }
+        case ErrorKind::NoMoreInstructions:
+            return std::format("no more instructions. pc={}", pc);
+        case ErrorKind::InvalidOperator: {
+            auto lhs = static_cast<ObjectKind>(operand >> 8);
+            auto rhs = static_cast<ObjectKind>(operand & 0xff);
+            if (lhs == ObjectKind::Bool || rhs == ObjectKind::Bool) {
+                return "operators not supported for Bool";
+            }
+            return "object are not of same type";
+        }
+        case ErrorKind::InvalidInstructionArgument:
+            return std::format("the instruction object at {} is not a {}", pc, object_kind_string(static_cast<ObjectKind>(operand)));
+        case ErrorKind::StackUnderflow:
+            return std::format("stack underflow at {}: {} needs {} values, found {}", pc, instruction_kind_string(instruction), instruction_pops(instruction), operand);
+        case ErrorKind::InvalidPointer:
+            return std::format("{} at {}: {} does not point to a heap object", instruction_kind_string(instruction), pc, operand);
+        case ErrorKind::OutOfBounds:
+            return std::format("{} at {}: index {} is out of bounds", instruction_kind_string(instruction), pc, operand);
+        case ErrorKind::OutOfMemory:
+            return std::format("{} at {}: an object of {} values exceeds the heap limit", instruction_kind_string(instruction), pc, operand);
+        default:
+            return std::format("error {}", static_cast<int>(error));
+    }
+}
+
 
 // __      ____  __ 
 // \ \    / /  \/  |
@@ -460,76 +637,267 @@ char const* Error::what() {
 //    \  /  | |  | |
 //     \/   |_|  |_|
 
-VM::VM(std::vector<Instruction> bytecode) : pc(0), stack({}), heap({}), bytecode(bytecode) {}
+namespace {
 
-void VM::tick(Error **error) {
-    Instruction instruction{InstructionKind::Last};
+struct ObjectHash {
+    size_t operator()(Object const& object) const {
+        return std::hash<u64>{}(object.data) ^ (static_cast<size_t>(object.kind) << 56);
+    }
+};
 
-    try {
-        instruction = bytecode.at(pc);
-        pc += 1;
-    } catch(std::out_of_range) {
-        *error = new Error(ErrorKind::NoMoreInstructions, strdup(std::format("no more instructions. pc={}", pc).c_str()), true);
-        return;
+// Only needed while a Code is built, so it is not kept in the Code
+using ConstantIndices = std::unordered_map<Object, u32, ObjectHash>;
+
+// Returns the index of the constant, adds it if it is new
+u32 intern(std::vector<Object>& constants, ConstantIndices& indices, Object const& constant) {
+    auto [entry, inserted] = indices.emplace(constant, static_cast<u32>(constants.size()));
+    if (inserted) {
+        constants.push_back(constant);
+    }
+    return entry->second;
+}
+
+}
+
+Code::Code() {
+    owned_kinds.push_back(InstructionKind::Last);
+    owned_constants.push_back(Object());
+    own();
+}
+
+Code::Code(std::vector<Instruction> const& bytecode) {
+    owned_kinds.reserve(bytecode.size() + 1);
+    owned_arguments.reserve(bytecode.size());
+    owned_constants.push_back(Object());
+    ConstantIndices indices{{Object(), 0}};
+
+    for (auto const& instruction : bytecode) {
+        owned_kinds.push_back(instruction.kind);
+        owned_arguments.push_back(instruction.value != nullptr ? intern(owned_constants, indices, *instruction.value) : 0);
+    }
+    owned_kinds.push_back(InstructionKind::Last);
+    own();
+}
+
+Code::Code(std::span<InstructionKind const> kinds, std::span<u32 const> arguments, std::span<Object const> constants, std::shared_ptr<void const> storage)
+    : kinds(kinds), arguments(arguments), constants(constants), storage(std::move(storage)) {}
+
+Code::Code(Code const& rhs) {
+    *this = rhs;
+}
+
+Code& Code::operator=(Code const& rhs) {
+    if (this == &rhs) {
+        return *this;
     }
-    instruction.check(error);
-    if (*error != nullptr) {
+
+    verified = rhs.verified;
+    stack_depth_known = rhs.stack_depth_known;
+    max_stack_depth = rhs.max_stack_depth;
+    stack_depths = rhs.stack_depths;
+    fuel = rhs.fuel;
+    fused_kinds = rhs.fused_kinds;
+    jit = rhs.jit;
+    registers = rhs.registers;
+    owned_kinds = rhs.owned_kinds;
+    owned_arguments = rhs.owned_arguments;
+    owned_constants = rhs.owned_constants;
+    storage = rhs.storage;
+
+    if (storage != nullptr) {
+        kinds = rhs.kinds;
+        arguments = rhs.arguments;
+        constants = rhs.constants;
+    } else {
+        own();
+    }
+    return *this;
+}
+
+void Code::own() {
+    if (storage != nullptr) {
+        owned_kinds.assign(kinds.begin(), kinds.end());
+        owned_arguments.assign(arguments.begin(), arguments.end());
+        owned_constants.assign(constants.begin(), constants.end());
+        storage = nullptr;
+    }
+    kinds = owned_kinds;
+    arguments = owned_arguments;
+    constants = owned_constants;
+}
+
+void Code::push(Instruction const& instruction) {
+    verified = false;
+    stack_depth_known = false;
+    fused_kinds.clear();
+    jit = nullptr;
+    registers = nullptr;
+    own();
+
+    owned_kinds.back() = instruction.kind;
+    owned_kinds.push_back(InstructionKind::Last);
+    u32 argument = 0;
+    if (instruction.value != nullptr) {
+        // A single push searches the pool instead of building an index
+        auto found = std::find(owned_constants.begin(), owned_constants.end(), *instruction.value);
+        argument = static_cast<u32>(found - owned_constants.begin());
+        if (found == owned_constants.end()) {
+            owned_constants.push_back(*instruction.value);
+        }
+    }
+    owned_arguments.push_back(argument);
+    own();
+}
+
+Object const* Code::operand(u64 pc) const {
+    Object const& value = constants[arguments[pc]];
+    if (value.kind == ObjectKind::Last) {
+        return nullptr;
+    }
+    return &value;
+}
+
+void Code::fuse() {
+    fused_kinds.assign(kinds.begin(), kinds.end());
+
+    for (u64 pc = 0; pc + 1 < size(); pc++) {
+#define _X(kind, first, second)                                                                     \
+        if (kinds[pc] == InstructionKind::first && kinds[pc + 1] == InstructionKind::second) {      \
+            fused_kinds[pc] = InstructionKind::kind;                                                \
+            continue;                                                                               \
+        }
+        SUPERINSTRUCTION_KIND
+#undef _X
+    }
+}
+
+Instruction Code::instruction(u64 pc) const {
+    Object const *value = operand(pc);
+    if (value == nullptr) {
+        return Instruction(kinds[pc]);
+    }
+    return Instruction(kinds[pc], new Object(*value));
+}
+
+Program::Program() : shared(std::make_shared<Code>()) {}
+
+Program::Program(std::vector<Instruction> const& bytecode) : Program(Code(bytecode)) {}
+
+Program::Program(Code code) : shared(std::make_shared<Code>(std::move(code))) {
+    Error *error = nullptr;
+    shared->verify(&error);
+    if (error != nullptr) {
+        // The program is run unverified, the error is reported once the
+        // offending instruction is reached.
+        delete error;
         return;
     }
 
-    switch (instruction.kind) {
-        case InstructionKind::Push: {
-            stack.push(*instruction.value);
-            break;
+    shared->analyze_stack();
+    if (shared->stack_depth_known) {
+        shared->fuse();
+    }
+}
+
+long Program::use_count() const {
+    return shared.use_count();
+}
+
+Code& Program::edit() {
+    if (shared.use_count() > 1) {
+        shared = std::make_shared<Code>(*shared);
+    }
+    return *shared;
+}
+
+VM::VM(std::vector<Instruction> bytecode) : VM(Program(bytecode)) {}
+
+VM::VM(Code code) : VM(Program(std::move(code))) {}
+
+VM::VM(Program program) : pc(0), stack({}), heap({}), program(std::move(program)) {
+    stack.reserve(this->program->max_stack_depth);
+}
+
+void VM::tick(Error **error) {
+    Status status = step();
+#if RVM_PROFILE
+    // The time until the next tick is not part of the instruction
+    profile.stop();
+#endif
+
+    if (status.kind == StatusKind::Halt) {
+        *error = new Error(error_status(ErrorKind::NoMoreInstructions, InstructionKind::Last, pc, 0));
+    } else if (status.kind == StatusKind::Error) {
+        *error = new Error(status);
+    }
+}
+
+Status VM::step() {
+    Code const& code = *program;
+    if (pc >= code.size()) {
+        return Status{StatusKind::Halt, ErrorKind::InvalidObject, InstructionKind::Last, pc, 0};
+    }
+
+    u64 current = pc;
+    InstructionKind kind = code.kinds[pc];
+    Object const *value = code.operand(pc);
+    // Only a stack of the depth the analysis found can skip the checks, a
+    // program stopped by an error leaves a different one behind
+    bool trusted = code.stack_depth_known && stack.size() == code.stack_depths[pc];
+    pc += 1;
+#if RVM_PROFILE
+    profile.record(kind, current);
+#endif
+
+    if (!code.verified) {
+        Status status = validate_instruction(kind, value);
+        if (!status.ok()) {
+            status.pc = current;
+            return status;
         }
+    }
 
-        case InstructionKind::Nop:
-            break;
-        case InstructionKind::Add: {
-            auto rhs = stack.pop();
-            auto lhs = stack.pop();
+    if (!trusted && stack.size() < instruction_pops(kind)) {
+        return error_status(ErrorKind::StackUnderflow, kind, current, stack.size());
+    }
 
-            auto result = lhs.apply_operator(Operator::Add, rhs, error);
-            if (*error != nullptr) {
-                return;
+    switch (kind) {
+        case InstructionKind::Push: {
+            if (trusted) {
+                stack.push_unchecked(*value);
+            } else {
+                stack.push(*value);
             }
-            stack.push(result);
             break;
         }
+
+        case InstructionKind::Nop:
+            break;
+        case InstructionKind::Add:
         case InstructionKind::Sub: {
             auto rhs = stack.pop();
             auto lhs = stack.pop();
 
-            auto result = lhs.apply_operator(Operator::Sub, rhs, error);
-            if (*error != nullptr) {
-                return;
+            if (!operator_applicable(lhs, rhs)) {
+                return error_status(ErrorKind::InvalidOperator, kind, current, operator_kinds(lhs, rhs));
             }
-            stack.push(result);
+            // There is room for the result, because two values were popped
+            stack.push_unchecked(Object(lhs.kind, kind == InstructionKind::Sub ? lhs.data - rhs.data : lhs.data + rhs.data));
             break;
         }
         case InstructionKind::Jmp: {
-            if(instruction.value->kind != ObjectKind::U64) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a U64", pc).c_str()), true);
-                return;
-            }
-
-            pc = std::get<u64>(instruction.value->data);
+            pc = value->data;
             break;
         }
         case InstructionKind::JmpIf: {
             auto cond = stack.pop();
-            if(instruction.value->kind != ObjectKind::U64) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a U64", pc).c_str()), true);
-                return;
-            }
 
             if (cond.kind != ObjectKind::Bool) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a Bool", pc).c_str()), true);
-                return;
+                return error_status(ErrorKind::InvalidInstructionArgument, kind, current, static_cast<u64>(ObjectKind::Bool));
             }
 
-            if (std::get<bool>(cond.data)) {
-                pc = std::get<u64>(instruction.value->data);
+            if (cond.boolean()) {
+                pc = value->data;
             }
             break;
         }
@@ -537,11 +905,10 @@ void VM::tick(Error **error) {
             auto address = stack.pop();
 
             if (address.kind != ObjectKind::U64) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a U64", pc).c_str()), true);
-                return;
+                return error_status(ErrorKind::InvalidInstructionArgument, kind, current, static_cast<u64>(ObjectKind::U64));
             }
 
-            pc = std::get<u64>(address.data);
+            pc = address.data;
             break;
         }
         case InstructionKind::JmpIfO: {
@@ -549,25 +916,384 @@ void VM::tick(Error **error) {
             auto cond = stack.pop();
 
             if (address.kind != ObjectKind::U64) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a U64", pc).c_str()), true);
-                return;
+                return error_status(ErrorKind::InvalidInstructionArgument, kind, current, static_cast<u64>(ObjectKind::U64));
             }
             if (cond.kind != ObjectKind::Bool) {
-                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("the instruction object at {} is not a Bool", pc).c_str()), true);
-                return;
+                return error_status(ErrorKind::InvalidInstructionArgument, kind, current, static_cast<u64>(ObjectKind::Bool));
             }
 
-            if (std::get<bool>(cond.data)) {
-                pc = std::get<u64>(address.data);
+            if (cond.boolean()) {
+                pc = address.data;
+            }
+            break;
+        }
+        case InstructionKind::Alloc: {
+            auto size = stack.pop();
+            Object pointer;
+            Status status = heap_allocate(heap, current, size, std::span<Object>(stack.c.data(), stack.count), &pointer);
+            if (!status.ok()) {
+                return status;
+            }
+            stack.push_unchecked(pointer);
+            break;
+        }
+        case InstructionKind::Load: {
+            auto index = stack.pop();
+            auto pointer = stack.pop();
+            Status status = heap_check(heap, kind, current, pointer, index);
+            if (!status.ok()) {
+                return status;
             }
+            stack.push_unchecked(pointer);
+            stack.push_unchecked(heap.load(pointer, index.data));
             break;
         }
+        case InstructionKind::Store: {
+            auto value = stack.pop();
+            auto index = stack.pop();
+            auto pointer = stack.pop();
+            Status status = heap_store(heap, current, pointer, index, value);
+            if (!status.ok()) {
+                return status;
+            }
+            stack.push_unchecked(pointer);
+            break;
+        }
+        // Superinstructions only exist in fused_kinds
+#define _X(kind, ...) case InstructionKind::kind:
+        SUPERINSTRUCTION_KIND
+#undef _X
+        case InstructionKind::LastSuperinstruction:
         case InstructionKind::Last: {
             abort();
             break;
         }
     }
+
+    return Status{};
 }
 
-};
+Status VM::run() {
+    Code const& code = *program;
+    // The native code and the register engine do not count what they execute
+#if !RVM_PROFILE
+    if (u32 entry = register_entry(); entry != none) {
+        return run_registers<false>(entry, nullptr);
+    }
+
+    while (code.jit != nullptr && pc < code.size() && stack.size() == code.stack_depths[pc]) {
+        // Stops at the end of the program, before an instruction which
+        // fails, before a heap instruction or right away if the native code
+        // can not be entered at pc. step executes the instruction or
+        // reports its error.
+        auto result = internal::jit_run(*code.jit, stack.c.data(), pc, stack.size());
+        pc = result.pc;
+        stack.count = result.depth;
+        if (pc >= code.size()) {
+            break;
+        }
+        Status status = step();
+        if (!status.ok()) {
+            return status;
+        }
+    }
+#endif
+
+    if (code.stack_depth_known && (pc >= code.size() || stack.size() == code.stack_depths[pc])) {
+        return run_verified<false>(0);
+    }
+    return run_checked(0, false);
+}
+
+Status VM::run_for(u64 budget) {
+    Code const& code = *program;
+    if (code.stack_depth_known && (pc >= code.size() || stack.size() == code.stack_depths[pc])) {
+        return run_verified<true>(budget);
+    }
+    return run_checked(budget, true);
+}
+
+Status VM::run_counting(u64 *dispatches) {
+    Code const& code = *program;
+    *dispatches = 0;
+#if !RVM_PROFILE
+    if (u32 entry = register_entry(); entry != none) {
+        return run_registers<true>(entry, dispatches);
+    }
+#endif
+
+    // Steps through the stack code. Where run executes a superinstruction,
+    // its second instruction is part of the same dispatch. Reaching the end
+    // of the program is a dispatch as well.
+    for (;;) {
+        u64 current = pc;
+        bool fused = code.stack_depth_known && !code.fused_kinds.empty() && pc < code.size()
+            && stack.size() == code.stack_depths[pc] && code.fused_kinds[pc] > InstructionKind::Last;
+        *dispatches += 1;
+        Status status = step();
+        if (!status.ok()) {
+            return status;
+        }
+        if (fused && pc == current + 1) {
+            status = step();
+            if (!status.ok()) {
+                return status;
+            }
+        }
+    }
+}
+
+Status VM::run_checked(u64 budget, bool metered) {
+    Code const& code = *program;
+    // Every instruction costs one fuel
+    u64 used = 0;
+    for (;;) {
+        if (metered && budget-- == 0 && pc < code.size()) {
+#if RVM_PROFILE
+            profile.stop();
+#endif
+            return Status{StatusKind::BudgetExhausted, ErrorKind::InvalidObject, InstructionKind::Last, pc, used};
+        }
+
+        Status status = step();
+        if (!status.ok()) {
+#if RVM_PROFILE
+            profile.stop();
+#endif
+            if (metered && status.kind == StatusKind::Halt) {
+                status.operand = used;
+            }
+            return status;
+        }
+        used++;
+    }
+}
 
+RVM_DISPATCH_BEGIN
+
+// The code is verified and the stack depth of every instruction is known, so
+// the loop neither checks instructions nor the stack. The program counter and
+// the stack pointer live in locals and are written back before returning.
+template <bool metered>
+Status VM::run_verified(u64 budget) {
+    Code const& code = *program;
+    // Superinstructions never contain a jump, so the fuel is the same
+    InstructionKind const *kinds = code.fused_kinds.empty() ? code.kinds.data() : code.fused_kinds.data();
+    u32 const *fuel = code.fuel.data();
+    u32 const *arguments = code.arguments.data();
+    Object const *constants = code.constants.data();
+    Object *base = stack.c.data();
+    Object *sp = base + stack.count;
+    u64 pc = this->pc;
+    // Fuel of the blocks started, reported by run_for
+    u64 charged = 0;
+    Status status{StatusKind::Halt, ErrorKind::InvalidObject, InstructionKind::Last, 0, 0};
+
+// Charges the fuel of the instructions up to the next jump, called when
+// starting and after every jump. Nothing is left to charge at the end of the
+// program.
+#define CHARGE()                                                    \
+    do {                                                            \
+        if (metered && fuel[pc] != 0) {                             \
+            if (budget == 0) goto exhausted;                        \
+            charged += fuel[pc];                                    \
+            budget = budget > fuel[pc] ? budget - fuel[pc] : 0;     \
+        }                                                           \
+    } while (0)
+
+#if RVM_PROFILE
+#define PROFILE() profile.record(kinds[pc], pc)
+#else
+#define PROFILE() do {} while (0)
+#endif
+
+#if RVM_THREADED_DISPATCH
+    static void *const labels[] = {
+#define _X(kind, ...) &&op_##kind,
+        INSTRUCTION_KIND
+#undef _X
+        &&op_Last,
+#define _X(kind, ...) &&op_##kind,
+        SUPERINSTRUCTION_KIND
+#undef _X
+        &&op_LastSuperinstruction,
+    };
+
+    CHARGE();
+
+#define CASE(kind) op_##kind:
+#define DISPATCH()                                                  \
+    do {                                                            \
+        PROFILE();                                                  \
+        goto *labels[static_cast<u8>(kinds[pc])];                   \
+    } while (0)
+
+    DISPATCH();
+    {
+#else
+    CHARGE();
+
+#define CASE(kind) case InstructionKind::kind:
+#define DISPATCH() continue
+
+    for (;;) {
+        PROFILE();
+        switch (kinds[pc]) {
+#endif
+        CASE(Nop) {
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Push) {
+            *sp++ = constants[arguments[pc]];
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Add) {
+            sp -= 2;
+            if (!operator_applicable(sp[0], sp[1])) [[unlikely]] {
+                status = error_status(ErrorKind::InvalidOperator, InstructionKind::Add, pc, operator_kinds(sp[0], sp[1]));
+                pc += 1;
+                goto done;
+            }
+            sp[0].data += sp[1].data;
+            sp += 1;
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Sub) {
+            sp -= 2;
+            if (!operator_applicable(sp[0], sp[1])) [[unlikely]] {
+                status = error_status(ErrorKind::InvalidOperator, InstructionKind::Sub, pc, operator_kinds(sp[0], sp[1]));
+                pc += 1;
+                goto done;
+            }
+            sp[0].data -= sp[1].data;
+            sp += 1;
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Jmp) {
+            pc = constants[arguments[pc]].data;
+            CHARGE();
+            DISPATCH();
+        }
+        CASE(JmpIf) {
+            Object cond = *--sp;
+            if (cond.kind != ObjectKind::Bool) [[unlikely]] {
+                status = error_status(ErrorKind::InvalidInstructionArgument, InstructionKind::JmpIf, pc, static_cast<u64>(ObjectKind::Bool));
+                pc += 1;
+                goto done;
+            }
+            pc = cond.boolean() ? constants[arguments[pc]].data : pc + 1;
+            CHARGE();
+            DISPATCH();
+        }
+        CASE(Alloc) {
+            sp -= 1;
+            // The collector finds the roots through the stack
+            stack.count = sp - base;
+            Status result = heap_allocate(heap, pc, sp[0], std::span<Object>(base, sp), sp);
+            if (!result.ok()) [[unlikely]] {
+                status = result;
+                pc += 1;
+                goto done;
+            }
+            sp += 1;
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Load) {
+            sp -= 2;
+            Status result = heap_check(heap, InstructionKind::Load, pc, sp[0], sp[1]);
+            if (!result.ok()) [[unlikely]] {
+                status = result;
+                pc += 1;
+                goto done;
+            }
+            sp[1] = heap.load(sp[0], sp[1].data);
+            sp += 2;
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(Store) {
+            sp -= 3;
+            Status result = heap_store(heap, pc, sp[0], sp[1], sp[2]);
+            if (!result.ok()) [[unlikely]] {
+                status = result;
+                pc += 1;
+                goto done;
+            }
+            sp += 1;
+            pc += 1;
+            DISPATCH();
+        }
+        CASE(PushAdd) {
+            Object rhs = constants[arguments[pc]];
+            sp -= 1;
+            if (!operator_applicable(sp[0], rhs)) [[unlikely]] {
+                status = error_status(ErrorKind::InvalidOperator, InstructionKind::Add, pc + 1, operator_kinds(sp[0], rhs));
+                pc += 2;
+                goto done;
+            }
+            sp[0].data += rhs.data;
+            sp += 1;
+            pc += 2;
+            DISPATCH();
+        }
+        CASE(PushSub) {
+            Object rhs = constants[arguments[pc]];
+            sp -= 1;
+            if (!operator_applicable(sp[0], rhs)) [[unlikely]] {
+                status = error_status(ErrorKind::InvalidOperator, InstructionKind::Sub, pc + 1, operator_kinds(sp[0], rhs));
+                pc += 2;
+                goto done;
+            }
+            sp[0].data -= rhs.data;
+            sp += 1;
+            pc += 2;
+            DISPATCH();
+        }
+        CASE(PushPush) {
+            sp[0] = constants[arguments[pc]];
+            sp[1] = constants[arguments[pc + 1]];
+            sp += 2;
+            pc += 2;
+            DISPATCH();
+        }
+        // Code with dynamic jumps never has a known stack depth
+        CASE(JmpO)
+        CASE(JmpIfO)
+        CASE(Last)
+        CASE(LastSuperinstruction) {
+            status.pc = pc;
+            goto done;
+        }
+#if !RVM_THREADED_DISPATCH
+        }
+#endif
+    }
+
+#undef CASE
+#undef DISPATCH
+#undef CHARGE
+#undef PROFILE
+
+exhausted:
+    status = Status{StatusKind::BudgetExhausted, ErrorKind::InvalidObject, InstructionKind::Last, pc, 0};
+
+done:
+#if RVM_PROFILE
+    profile.stop();
+#endif
+    if (metered && status.kind != StatusKind::Error) {
+        status.operand = charged;
+    }
+    this->pc = pc;
+    stack.count = sp - base;
+    return status;
+}
+
+RVM_DISPATCH_END
+
+};
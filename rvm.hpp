@@ -3,9 +3,14 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
 #include <string_view>
 #include <tuple>
-#include <variant>
+#include <type_traits>
 #include <vector>
 
 namespace rvm {
@@ -21,31 +26,48 @@ class VM;
 namespace internal {
 template <class T>
 struct Stack {
-    // Internal collection
+    // Internal collection, its size is the capacity of the stack
     std::vector<T> c;
+    // Amount of values on the stack
+    size_t         count = 0;
 
     size_t size() const {
-        return c.size();
+        return count;
     }
 
     T& operator[](size_t index) {
         return c[index];
     }
 
+    // Makes room for at least capacity values
+    void reserve(size_t capacity) {
+        if (c.size() < capacity) {
+            c.resize(capacity);
+        }
+    }
+
+    // Grows the stack if there is no room left
     void push(T value) {
-        c.push_back(value);
+        if (count == c.size()) {
+            c.resize(c.size() * 2 + 16);
+        }
+        c[count++] = value;
+    }
+
+    // Does not grow the stack, there has to be room for the value
+    void push_unchecked(T value) {
+        c[count++] = value;
     }
 
+    // Does not check for underflow, the stack must not be empty
     T pop() {
-        T value = c[c.size() - 1];
-        c.pop_back();
-        return value;
+        return c[--count];
     }
 
     // Returns nullptr if the stack has no top value
     T* top() {
-        if (c.size() > 0) {
-            return &c.back();
+        if (count > 0) {
+            return &c[count - 1];
         }
 
         return nullptr;
@@ -54,22 +76,41 @@ struct Stack {
 };
 
 using Stack = internal::Stack<Object>;
-using Heap = std::vector<Object>;
 
+// _X(kind, arguments, pops, pushes)
+// pops and pushes are the amount of values the instruction takes from and
+// puts onto the stack.
 #define INSTRUCTION_KIND                                        \
     /*                                                     */   \
-    _X(Nop,  0) /* No operation, do nothing */                  \
-    _X(Push, 1) /* Push the following object onto the stack*/   \
+    _X(Nop,  0, 0, 0) /* No operation, do nothing */            \
+    _X(Push, 1, 0, 1) /* Push the following object onto the stack*/ \
     /* Pops 2 values from the stack and returns the result */   \
-    _X(Add, 0)                                                  \
-    _X(Sub, 0)                                                  \
+    _X(Add, 0, 2, 1)                                            \
+    _X(Sub, 0, 2, 1)                                            \
     /* Jump to the static address in the object.           */   \
-    _X(Jmp,   1)                                                \
-    _X(JmpIf, 1)                                                \
+    _X(Jmp,   1, 0, 0)                                          \
+    _X(JmpIf, 1, 1, 0)                                          \
     /* Same as the normal jumps but uses the object on the stack
        The object has to be a u64 currently.               */   \
-    _X(JmpO,   0)                                               \
-    _X(JmpIfO, 0)
+    _X(JmpO,   0, 1, 0)                                         \
+    _X(JmpIfO, 0, 2, 0)                                         \
+    /* Heap objects, see Heap. Alloc pops a U64 size and pushes a
+       Pointer to that many values. Load pops a Pointer and a U64
+       index and pushes the Pointer and the value, Store pops a
+       Pointer, a U64 index and a value and pushes the Pointer.
+       The Pointer stays, so objects can be used repeatedly. */ \
+    _X(Alloc, 0, 1, 1)                                          \
+    _X(Load,  0, 2, 2)                                          \
+    _X(Store, 0, 3, 1)
+
+// Superinstructions execute two instructions with a single dispatch. They
+// only exist in Code::fused_kinds, which is used by the dispatch loop of
+// VM::run, and are never written to a file.
+// _X(kind, first, second)
+#define SUPERINSTRUCTION_KIND                                   \
+    _X(PushAdd,  Push, Add)                                     \
+    _X(PushSub,  Push, Sub)                                     \
+    _X(PushPush, Push, Push)
 
 enum class InstructionKind: u8 {
 #define _X(kind, ...) kind,
@@ -77,15 +118,27 @@ enum class InstructionKind: u8 {
 #undef _X
 
     Last,
+
+    // Directly after Last, so the dispatch table stays dense
+#define _X(kind, ...) kind,
+    SUPERINSTRUCTION_KIND
+#undef _X
+
+    LastSuperinstruction,
 };
 
-char const* instruction_string(const InstructionKind& kind);
+char const* instruction_kind_string(const InstructionKind& kind);
 size_t instruction_argument_amount(const InstructionKind& kind);
+size_t instruction_pops(const InstructionKind& kind);
+size_t instruction_pushes(const InstructionKind& kind);
 
 static_assert(InstructionKind::Last <= static_cast<InstructionKind>((1 << 7)), "The last bit is reserved for multi byte instructions");
+static_assert(InstructionKind::LastSuperinstruction <= static_cast<InstructionKind>((1 << 7)), "The last bit is reserved for multi byte instructions");
 
 struct Instruction {
     InstructionKind kind;
+    // Set if value belongs to an ObjectArena, which frees it
+    bool            borrowed = false;
     // NOTE: Nullable
     Object         *value;
 
@@ -130,14 +183,83 @@ enum class ObjectKind: u8 {
 
 char const* object_kind_string(const ObjectKind& kind);
 
+enum class ErrorKind {
+    // Bytecode Parsing Errors
+    InvalidObject,
+    InvalidInstruction,
+    InvalidContainer,
+    InvalidSnapshot,
+    ProfilerUnavailable,
+
+    // File Errors
+    FileNotFound,
+    FileError,
+    UnexpectedEOF,
+
+    // VM Execution Errors
+    NoMoreInstructions,
+    InvalidOperator,
+    InvalidInstructionArgument,
+    StackUnderflow,
+    InvalidPointer,
+    OutOfBounds,
+    OutOfMemory,
+};
+
+enum class StatusKind: u8 {
+    // The instruction was executed, the program continues
+    Ok,
+    // The program counter reached the end of the program
+    Halt,
+    // The budget passed to VM::run_for was used up, run can be called again
+    BudgetExhausted,
+    Error,
+};
+
+// Outcome of executing instructions. A Status is plain data, so reporting an
+// error does not allocate. The message is only formatted when calling what.
+struct Status {
+    StatusKind      kind = StatusKind::Ok;
+    // Only valid if kind is StatusKind::Error
+    ErrorKind       error = ErrorKind::InvalidObject;
+    InstructionKind instruction = InstructionKind::Last;
+    // Program counter of the instruction the status is about
+    u64             pc = 0;
+    // Depends on error:
+    //   InvalidOperator:            lhs object kind << 8 | rhs object kind
+    //   InvalidInstructionArgument: the expected object kind
+    //   InvalidInstruction:         the object kind of the argument
+    //   InvalidObject:              the object kind
+    //   StackUnderflow:             the size of the stack
+    //   InvalidPointer:             the data of the pointer
+    //   OutOfBounds:                the index
+    //   OutOfMemory:                the requested size, for Store the used values
+    // Halt and BudgetExhausted returned by VM::run_for hold the fuel used
+    // by the call.
+    u64             operand = 0;
+
+    bool ok() const {
+        return kind == StatusKind::Ok;
+    }
+
+    std::string what() const;
+};
+
+
+// A tagged value. kind is the only tag, U64 and Pointer store their value in
+// data directly and Bool stores 0 or 1.
 class Object {
-    template <class T>
-    bool holds(Error **error);
 public:
-    ObjectKind kind;
-    std::variant<
-        u64, bool
-    > data;
+    ObjectKind kind = ObjectKind::Last;
+    u64        data = 0;
+
+    Object() = default;
+    Object(ObjectKind kind, u64 data) : kind(kind), data(data) {}
+    Object(ObjectKind kind, bool data) : kind(kind), data(data ? 1 : 0) {}
+
+    bool boolean() const {
+        return data != 0;
+    }
 
     // Does not check if this is a valid instruction
     // Please check using the check function
@@ -148,41 +270,748 @@ public:
 
     std::string string();
     // Checks if the object is valid
-    void check(Error **error);
+    void check(Error **error) const;
+    // Same as check, but does not allocate
+    Status validate() const;
 
     Object apply_operator(Operator op, Object rhs, Error **error);
 };
 
+static_assert(sizeof(Object) == 16, "Objects are stored inline on the stack and in the code");
+static_assert(std::is_trivially_copyable_v<Object>, "Objects are read from mapped files");
+
+// Checks if the instruction kind and its object argument are valid
+void check_instruction(InstructionKind kind, Object const *value, Error **error);
+// Same as check_instruction, but does not allocate
+Status validate_instruction(InstructionKind kind, Object const *value);
+
+// Verifies a whole program once: every instruction has to be valid and every
+// static jump target has to be inside the program. A jump to bytecode.size()
+// is allowed and ends the program.
+void verify(std::vector<Instruction> const& bytecode, Error **error);
+
+// Rewrites the program into a shorter one with the same behaviour: constant
+// Add and Sub are folded, jumps with constant arguments become static jumps,
+// jump chains are collapsed and unreachable instructions and Nops are
+// removed. Programs which fail verify are left unchanged. Instructions are
+// only moved if the program has no JmpO or JmpIfO left, because their
+// targets are not known before running.
+void optimize(std::vector<Instruction>& bytecode);
+
+// Shape of the programs built by generate
+struct GenerateOptions {
+    u64    seed = 1;
+    // Exact amount of instructions
+    u64    size = 1000;
+    // Chance to start a jump at every instruction where one can start
+    double branch_density = 0.05;
+    // Share of the jumps which use JmpO and JmpIfO instead of static jumps
+    double dynamic_jumps = 0;
+    // The stack never holds more values
+    u64    max_stack_depth = 16;
+    // Amount of distinct U64 constants pushed, every push picks one of them
+    u64    constants = 64;
+};
+
+// Builds a random program, the same options always build the same program.
+// Generated programs pass verify and halt without an error: every jump goes
+// forward, Add and Sub only see U64 values and every jump target is reached
+// with exactly one value on the stack.
+std::vector<Instruction> generate(GenerateOptions const& options);
+
+// Owns the operands of many instructions and frees them all at once. The
+// objects are carved out of chunks which grow with every allocation, so
+// loading a program allocates a few times instead of once per operand.
+// Instructions borrowing from an arena do not delete their operand and must
+// be destroyed before the arena, copies of them own their operand again.
+class ObjectArena {
+public:
+    ObjectArena() = default;
+    ObjectArena(ObjectArena const&) = delete;
+    ObjectArena& operator=(ObjectArena const&) = delete;
+
+    // Returns a copy of object which lives as long as the arena
+    Object     *make(Object object);
+    // Returns an instruction borrowing its operand from the arena
+    Instruction instruction(InstructionKind kind, Object value);
+
+    // Amount of objects made
+    u64         size() const {
+        return made;
+    }
+
+private:
+    static constexpr size_t first_chunk = 64;
+    static constexpr size_t max_chunk = 64 * 1024;
+
+    std::vector<std::unique_ptr<Object[]>> chunks{};
+    Object                                *next = nullptr;
+    Object                                *end = nullptr;
+    size_t                                 chunk_size = 0;
+    u64                                    made = 0;
+};
+
 std::vector<Instruction> bytecode_from_file(std::string_view filename, Error **error);
 std::vector<Instruction> bytecode_from_file(FILE *file, Error **error);
+// Same as above, but the operands are allocated in arena
+std::vector<Instruction> bytecode_from_file(std::string_view filename, ObjectArena& arena, Error **error);
+std::vector<Instruction> bytecode_from_file(FILE *file, ObjectArena& arena, Error **error);
+
+// Three address instructions of the register engine, see Code::translate.
+// The registers are the stack slots, register i holds the value at stack
+// depth i. Constant pushes are not executed, the constant is used directly
+// by the instruction which consumes it.
+// _X(op) /* semantics, operands are dst, lhs and rhs */
+#define REGISTER_OP                                             \
+    _X(Load)  /* r[dst] = constants[rhs]                  */    \
+    _X(Add)   /* r[dst] = r[lhs] + r[rhs]                 */    \
+    _X(AddK)  /* r[dst] = r[lhs] + constants[rhs]         */    \
+    _X(Sub)   /* r[dst] = r[lhs] - r[rhs]                 */    \
+    _X(SubK)  /* r[dst] = r[lhs] - constants[rhs]         */    \
+    _X(Jmp)   /* continue at instruction dst              */    \
+    _X(JmpIf) /* continue at instruction dst if r[lhs]    */    \
+    _X(Step)  /* executes the instruction at pc with step */    \
+    _X(Halt)  /* the end of the program was reached       */
+
+enum class RegisterOp: u8 {
+#define _X(op) op,
+    REGISTER_OP
+#undef _X
+};
+
+struct RegisterInstruction {
+    RegisterOp op;
+    u32        dst = 0;
+    u32        lhs = 0;
+    u32        rhs = 0;
+    // Stack depth before the instruction of the stack code at pc, this
+    // instruction was translated from. Used to hand over to the stack code.
+    u32        depth = 0;
+    u64        pc = 0;
+};
+
+struct RegisterCode {
+    std::vector<RegisterInstruction> instructions;
+    // Index into instructions for every instruction of the stack code which
+    // starts a basic block, all others can not be entered
+    std::vector<u32>                 entries;
+};
+
+namespace internal {
+// Native code of a program, see Code::compile
+struct JitCode;
+
+// Where the native code stopped, the interpreter continues from there
+struct JitResult {
+    u64 pc;
+    // Amount of values on the stack
+    u64 depth;
+};
+
+// Executes the native code starting at pc. stack has to be big enough for
+// the maximum stack depth and contain exactly the depth values the
+// instruction at pc expects. Returns pc and depth unchanged if the native
+// code can not be entered at pc.
+JitResult jit_run(JitCode const& jit, Object *stack, u64 pc, u64 depth);
+}
+
+// Flat, decoded representation of a program. It is built once from the
+// instructions and then read in place, so executing an instruction does not
+// copy or allocate anything. The arrays are either owned by the code or live
+// in memory kept alive by storage, for example a mapped file.
+struct Code {
+    // Always ends with an InstructionKind::Last, which marks the end of the
+    // program for the dispatch loop in VM::run.
+    std::span<InstructionKind const> kinds;
+    // Index into constants of the argument of every instruction.
+    // Instructions without an argument use index 0.
+    std::span<u32 const>             arguments;
+    // The deduplicated arguments of all instructions. The first constant is
+    // always an object of kind ObjectKind::Last, which means no argument.
+    std::span<Object const>          constants;
+    // Set by verify, cleared when the code is changed. Verified code is
+    // executed without checking every instruction again.
+    bool                             verified = false;
+
+    Code();
+    Code(std::vector<Instruction> const& bytecode);
+    // Uses the arrays in place, storage keeps them alive
+    Code(std::span<InstructionKind const> kinds, std::span<u32 const> arguments, std::span<Object const> constants, std::shared_ptr<void const> storage);
+    Code(Code const& rhs);
+    Code(Code &&rhs) = default;
+    Code& operator=(Code const& rhs);
+    Code& operator=(Code &&rhs) = default;
+
+    u64 size() const {
+        return kinds.size() - 1;
+    }
+
+    // Returns nullptr if the instruction at pc has no argument
+    Object const* operand(u64 pc) const;
+
+    void        push(Instruction const& instruction);
+    Instruction instruction(u64 pc) const;
+
+    // Set by analyze_stack. If the stack depth is known, the program can
+    // never underflow the stack and never needs more than max_stack_depth
+    // values when started at pc 0 with an empty stack.
+    bool                         stack_depth_known = false;
+    u64                          max_stack_depth = 0;
+    // Stack depth before every instruction, only valid if stack_depth_known
+    std::vector<u32>             stack_depths;
+    // Fuel charged by VM::run_for when control reaches pc: the amount of
+    // instructions up to and including the next jump. Set by analyze_stack
+    // together with stack_depths and ends with a 0 for the end of the
+    // program.
+    std::vector<u32>             fuel;
+
+    // Same as kinds, but the first instruction of every sequence in
+    // SUPERINSTRUCTION_KIND is replaced by its superinstruction. The second
+    // instruction keeps its kind, so it can still be jumped to. Empty until
+    // fuse is called, cleared when the code is changed.
+    std::vector<InstructionKind> fused_kinds;
+
+    // Native code of the program, empty until compile is called, cleared
+    // when the code is changed
+    std::shared_ptr<internal::JitCode const> jit;
+
+    // Register code of the program, empty until translate is called,
+    // cleared when the code is changed
+    std::shared_ptr<RegisterCode const>      registers;
+
+    // Checks every instruction once, see rvm::verify
+    void        verify(Error **error);
+    // Computes the stack depth before every instruction. Only works for
+    // verified code without JmpO and JmpIfO, whose targets are not known.
+    void        analyze_stack();
+    // Selects the superinstructions for fused_kinds
+    void        fuse();
+    // Compiles code with a known stack depth to x86-64 machine code, which
+    // VM::run executes instead of the dispatch loop. The top of the stack
+    // is kept in registers, pushed constants are folded into the
+    // instructions using them and kinds known at compile time are not
+    // checked. The native code writes the registers back and returns to
+    // the interpreter before an instruction would fail, so errors and the
+    // stack are the same. It can be entered at the start of every basic
+    // block and after Alloc, Load and Store, which have no template and
+    // are executed by VM::run with step. Leaves jit empty on other
+    // platforms.
+    void        compile();
+    // Translates code with a known stack depth to register code. Leaves
+    // registers empty otherwise. Alloc, Load and Store are executed by step
+    // in between, see RegisterOp::Step.
+    void        translate();
+
+private:
+    std::vector<InstructionKind> owned_kinds{};
+    std::vector<u32>             owned_arguments{};
+    std::vector<Object>          owned_constants{};
+    // Nullptr if the code owns its arrays
+    std::shared_ptr<void const>  storage{};
+
+    // Points the spans to the owned arrays
+    void        own();
+    // Sets fuel, see analyze_stack
+    void        compute_fuel();
+};
+
+// A run of instructions which is only entered at its first instruction
+// and only left after its last one
+struct BasicBlock {
+    // The instructions begin to end - 1
+    u64              begin = 0;
+    u64              end = 0;
+    std::vector<u32> successors{};
+    std::vector<u32> predecessors{};
+    // Reachable from the first block through static jumps and fallthroughs
+    bool             reachable = false;
+    // Not reachable, but the program has JmpO or JmpIfO, which could jump
+    // to it
+    bool             dynamic = false;
+    // The closest block every path from the first block has to go through.
+    // CFG::none for the first block and blocks which are not reachable.
+    u32              immediate_dominator = 0;
+};
+
+// Control flow graph of a program. Blocks start at the first instruction,
+// at every static jump target and after every jump. Edges follow static
+// jumps and fallthroughs, the targets of JmpO and JmpIfO are not known.
+// Jumps to the end of the program or outside of it have no edge. Blocks
+// and edges are built in linear time, dominators in O(m log n) for m edges
+// and n blocks.
+class CFG {
+public:
+    static constexpr u32 none = std::numeric_limits<u32>::max();
+
+    // Ordered by their first instruction, blocks[0] is the entry
+    std::vector<BasicBlock> blocks{};
+    // True if the program contains JmpO or JmpIfO
+    bool                    dynamic_jumps = false;
+
+    CFG(std::vector<Instruction> const& bytecode);
+    CFG(Code const& code);
+
+    // Returns the block containing the instruction at pc, none if pc is
+    // outside of the program
+    u32  block(u64 pc) const;
+    // True if every path from the entry to b goes through a. Only
+    // reachable blocks have dominators.
+    bool dominates(u32 a, u32 b) const;
+
+private:
+    // Block of every instruction
+    std::vector<u32> block_of{};
+    // Pre and post order numbers of the blocks in the dominator tree
+    std::vector<u32> dominator_enter{};
+    std::vector<u32> dominator_leave{};
+
+    template <class Kind, class Target>
+    void build(u64 size, Kind kind, Target target);
+    void compute_dominators();
+};
+
+enum class Encoding: u8 {
+    // The sections are laid out like Code and are executed in place
+    Fixed,
+    // Integers are stored as LEB128 varints and jump targets relative to
+    // their instruction. Smaller, but the loader has to decode the file.
+    Varint,
+};
+
+// Writes the code in the container format:
+//
+//   header   "RVMB", u16 version, u16 flags, u32 section count, u32 reserved
+//   sections u32 kind, u32 reserved, u64 offset, u64 size for every section
+//   kinds     one byte per instruction, followed by InstructionKind::Last
+//   arguments one u32 constant index per instruction
+//   constants one 16 byte Object per constant
+//
+// Every section starts at a multiple of 64 bytes and all values use the byte
+// order of the machine. The sections are laid out exactly like Code, so a
+// mapped file is executed in place.
+//
+// With Encoding::Varint, the header has the varint flag set and the file
+// has a code section with the kind of every instruction followed by its
+// argument as a varint: constant indices for Push and the zigzag encoded
+// distance to the target for Jmp and JmpIf. The constant section only holds
+// the constants of Push, the loader adds the jump targets. It starts with
+// the amount of constants as a varint, followed by the kind byte and the
+// varint data of every constant.
+void write_code(FILE *file, Code const& code, Error **error);
+void write_code(FILE *file, Code const& code, Encoding encoding, Error **error);
+// Writes the instructions in the container format, see write_code
+void write_bytecode(FILE *file, std::vector<Instruction> const& bytecode, Error **error);
+// Maps a container file into memory without parsing the instructions. Files
+// in the raw format written by Instruction::write are read and decoded.
+Code code_from_file(std::string_view filename, Error **error);
+
+enum class Engine: u8 {
+    // Executes the stack code
+    Stack,
+    // Executes the register code, see Code::translate
+    Register,
+};
+
+// Reference counted, immutable code. Copies share the same Code, so any
+// amount of VMs can execute a program which was decoded, verified and
+// analyzed once, while every VM only owns its pc, stack and heap.
+class Program {
+public:
+    Program();
+    // Verifies the code, computes its stack depths and selects its
+    // superinstructions. Invalid code is kept and checked while executing.
+    Program(Code code);
+    Program(std::vector<Instruction> const& bytecode);
+
+    Code const& operator*() const {
+        return *shared;
+    }
+    Code const* operator->() const {
+        return shared.get();
+    }
+
+    // Amount of programs sharing the code
+    long  use_count() const;
+    // Returns the code for changes. Shared code is copied first, so the
+    // other programs keep the old code.
+    Code& edit();
+
+private:
+    std::shared_ptr<Code> shared;
+};
+
+// Profiling is compiled out unless RVM_PROFILE is 1, see the profile
+// option in meson_options.txt. Everything linking against rvm has to use
+// the same value, it changes the layout of VM.
+#ifndef RVM_PROFILE
+#define RVM_PROFILE 0
+#endif
+
+// Execution counts and sampled times of a VM. Every dispatched instruction
+// is counted by its kind and pc, superinstructions under their own kind.
+// Only every sample_period-th instruction is timed, from its dispatch to
+// the next one, in ticks of the time stamp counter on x86 and nanoseconds
+// elsewhere.
+struct Profile {
+    static constexpr u64    sample_period = 97;
+    static constexpr size_t kinds = static_cast<size_t>(InstructionKind::LastSuperinstruction);
+
+    u64              kind_counts[kinds] = {};
+    u64              kind_ticks[kinds] = {};
+    u64              kind_samples[kinds] = {};
+    // Indexed by pc, grown as needed
+    std::vector<u64> pc_counts{};
+    std::vector<u64> pc_ticks{};
+    std::vector<u64> pc_samples{};
+    // The pc of the instruction being dispatched, read by the signal
+    // handler of PerfSampler
+    u64 volatile     current_pc = 0;
+
+    void record(InstructionKind kind, u64 pc) {
+        current_pc = pc;
+        kind_counts[static_cast<u8>(kind)]++;
+        if (pc >= pc_counts.size()) [[unlikely]] {
+            grow(pc);
+        }
+        pc_counts[pc]++;
+        if (--countdown == 0) [[unlikely]] {
+            sample(kind, pc);
+        }
+    }
+
+    // Drops the running sample, called when execution stops so the time
+    // until the next run is not measured
+    void stop();
+    void clear();
+
+    // Writes a table sorted by estimated time to file, at most rows lines
+    // per section
+    void write_table(FILE *file, Code const& code, size_t rows = 20) const;
+    // Writes the counts of every kind and pc as JSON or CSV with the
+    // columns scope, name, pc, count, samples, ticks
+    void write_json(FILE *file, Code const& code) const;
+    void write_csv(FILE *file, Code const& code) const;
+
+    // The unit of the ticks, "cycles" or "ns"
+    static char const* clock_unit();
+
+private:
+    u64             countdown = sample_period;
+    bool            sampling = false;
+    InstructionKind sample_kind = InstructionKind::Last;
+    u64             sample_pc = 0;
+    u64             sample_start = 0;
+
+    void grow(u64 pc);
+    void sample(InstructionKind kind, u64 pc);
+};
+
+// Garbage collected memory of a VM. A heap object is a header, an Object of
+// kind Last holding the amount of values, followed by its values. A Pointer
+// holds the index of the header.
+//
+// Objects are allocated by bumping the top of the active half of the heap.
+// Once it is full, the objects reachable from the roots are copied into the
+// other half with Cheney's algorithm and the halves swap, so a collection
+// costs time proportional to the live objects and never to the garbage. The
+// heap only grows during a collection which leaves it more than half full.
+//
+// Copies share the active half until one of them writes to it, the other
+// half is only allocated by the first collection. Copying a heap therefore
+// costs nothing until the copy or the original changes. A collection reads
+// a shared half in place and only copies the live objects out of it.
+//
+// Pointers which were not returned by allocate, like pushed constants, are
+// ignored by the collector and rejected by contains unless they happen to
+// point at a header, so no program can read outside of the heap.
+class Heap {
+public:
+    // Values of the first half, allocated with the first object
+    static constexpr u64 initial_capacity = 1024;
+    // Largest object allocate accepts
+    static constexpr u64 max_object_size = u64(1) << 32;
+    static constexpr u64 default_limit = u64(1) << 30;
+
+    // Most bytes both halves may use together. The heap does not grow
+    // beyond it, allocating fails instead.
+    u64    limit = default_limit;
+
+    Heap() = default;
+    // Shares the active half, see unshare
+    Heap(Heap const& rhs);
+    Heap& operator=(Heap const& rhs);
+    Heap(Heap&&) = default;
+    Heap& operator=(Heap&&) = default;
+
+    // Returns a Pointer to size values, which are all U64 0. Collects the
+    // heap first if the object does not fit, the pointers in roots are
+    // updated to the new locations. size must not exceed max_object_size.
+    // Returns an Object of kind Last if the object does not fit into the
+    // limit or the memory could not be allocated.
+    Object allocate(u64 size, std::span<Object> roots);
+    // Copies the objects reachable from roots into the other half and
+    // updates the pointers in roots. Returns false and leaves the heap
+    // unchanged if the other half could not be allocated.
+    bool   collect(std::span<Object> roots);
+
+    // Checks that pointer points at the header of an object
+    bool   contains(Object pointer) const;
+    // The amount of values of an object, pointer has to be contained
+    u64    size(Object pointer) const {
+        return (*space)[pointer.data].data;
+    }
+    // A value of an object, pointer has to be contained and index less
+    // than its size
+    Object load(Object pointer, u64 index) const {
+        return (*space)[pointer.data + 1 + index];
+    }
+    // Same preconditions as load. Returns false if the heap was shared and
+    // could not be copied.
+    bool   store(Object pointer, u64 index, Object value) {
+        if (!unshare()) [[unlikely]] {
+            return false;
+        }
+        (*space)[pointer.data + 1 + index] = value;
+        return true;
+    }
+
+    // Values in use, headers included
+    u64    used() const {
+        return top;
+    }
+    // Values of the active half
+    u64    capacity() const {
+        return space != nullptr ? space->size() : 0;
+    }
+    u64    collections() const {
+        return collected;
+    }
+    // The used values, starting with the header of the first object
+    Object const* data() const {
+        return space != nullptr ? space->data() : nullptr;
+    }
+    // Replaces the heap with count values laid out like data, which have
+    // to form valid objects. Returns false and leaves the heap unchanged if
+    // they do not fit into the limit.
+    bool   assign(void const *values, u64 count);
+
+private:
+    // The active half, shared with copies of the heap
+    std::shared_ptr<std::vector<Object>> space{};
+    // The other half, only used while collecting
+    std::vector<Object>                  spare{};
+    u64                                  top = 0;
+    u64                                  collected = 0;
+
+    // Copies the used values of a shared active half, so it can be
+    // changed. Returns false if the copy could not be allocated.
+    bool   unshare();
+    bool   reserve(u64 words, std::span<Object> roots);
+    bool   grow(u64 capacity);
+    // Most values of a half within the limit
+    u64    max_capacity() const;
+};
 
 class VM {
 public:
     u64                      pc = 0;
     Stack                    stack{};
     Heap                     heap{};
-    std::vector<Instruction> bytecode;
+    Program                  program;
+    // Used by run, see select
+    Engine                   engine = Engine::Stack;
+#if RVM_PROFILE
+    // Collected by run, run_for, step and tick. The native code and the
+    // register engine are not used while profiling.
+    Profile                  profile{};
+#endif
 
+    // Verifies the bytecode. Programs that pass are executed in trusted mode,
+    // all others are checked on every tick and report their errors there.
     VM(std::vector<Instruction> bytecode);
+    VM(Code code);
+    // Shares the program, nothing is copied or verified again
+    VM(Program program);
+
+    // Returns a VM with a copy of the pc and stack, which shares the program
+    // and shares the heap until one of them writes to it
+    VM           clone() const;
+    // Writes the pc, stack and heap into a blob, see restore:
+    //
+    //   header "RVMS", u16 version, u16 reserved, u32 reserved, u64 pc,
+    //          u64 stack size, u64 heap size
+    //   stack  one 16 byte Object per value, the bottom first
+    //   heap   the used values of the heap, headers included, see Heap
+    //
+    // All values use the byte order of the machine.
+    std::vector<u8> snapshot() const;
+    // Replaces the pc, stack and heap with the ones of a snapshot taken
+    // from a VM with the same program. The objects are copied as they are,
+    // so restoring costs about as much as a memcpy. The state is left
+    // unchanged if the blob is invalid.
+    void         restore(std::span<u8 const> blob, Error **error);
 
     // Tick advances the program counter and executes the corresponding instruction
+    // Reaching the end of the program is reported as a NoMoreInstructions error.
     void         tick(Error **error);
+    // Same as tick, but does not allocate. Returns StatusKind::Halt at the
+    // end of the program.
+    Status       step();
+
+    // Executes instructions until the program halts or an error occurs.
+    // Verified code with a known stack depth is executed by its native code
+    // if it was compiled and by a threaded dispatch loop otherwise,
+    // everything else by calling step.
+    Status       run();
+    // Same as run, but stops with StatusKind::BudgetExhausted once budget
+    // instructions were executed, run_for can be called again to continue.
+    // For code with a known stack depth, the fuel of the instructions up to
+    // the next jump is charged at once whenever the program starts or
+    // jumps, so the budget is only checked there. Such a block is executed
+    // completely once started and may overrun the budget by its length.
+    // The fuel used, one per executed instruction, is returned in the
+    // operand of the status unless an error occurs.
+    Status       run_for(u64 budget);
+    // Selects the engine used by run and translates the code if needed. The
+    // register engine is only used for code with a known stack depth, code
+    // with JmpO or JmpIfO always uses the stack engine. It starts at the
+    // beginning of basic blocks and executes heap instructions with step
+    // without leaving the register code. Errors and the stack are the
+    // same as with the stack engine. run_for always uses the stack code.
+    // Translating shared code copies it, translate it before sharing.
+    void         select(Engine engine);
+    // Same as run, but counts the dispatches of the engine executing the
+    // program: one per instruction of the stack code, where a
+    // superinstruction is a single dispatch, or one per register
+    // instruction. Reaching the end counts as one. Never uses the native code and is slower than run, it is
+    // meant for comparing the engines.
+    Status       run_counting(u64 *dispatches);
+
+private:
+    template <bool metered>
+    Status       run_verified(u64 budget);
+    Status       run_checked(u64 budget, bool metered);
+    // Returns where the register code continues at pc, or none if run has
+    // to use the stack code
+    static constexpr u32 none = std::numeric_limits<u32>::max();
+    u32          register_entry() const;
+    template <bool counted>
+    Status       run_registers(u32 entry, u64 *dispatches);
 };
 
-enum class ErrorKind {
-    // Bytecode Parsing Errors
-    InvalidObject,
-    InvalidInstruction,
+namespace internal {
+struct Task;
+struct SchedulerState;
+struct PerfHandler;
+}
 
-    // File Errors
-    FileNotFound,
-    FileError,
-    UnexpectedEOF,
+// Runs many VMs on a pool of worker threads. Every worker owns a deque of
+// runnable VMs, executes the one at the front with VM::run_for for a slice
+// of fuel and moves it to the back if it did not finish. Idle workers steal
+// from the back of the other deques, so the work spreads across all cores.
+class Scheduler {
+public:
+    // Counters of a single worker, updated while it is running
+    struct Statistics {
+        // Calls to VM::run_for
+        u64 slices = 0;
+        // VMs taken from the deque of another worker
+        u64 steals = 0;
+        // VMs which halted or failed on this worker
+        u64 completed = 0;
+        // Times the worker went to sleep without any runnable VM
+        u64 sleeps = 0;
+    };
 
-    // VM Execution Errors
-    NoMoreInstructions,
-    InvalidOperator,
-    InvalidInstructionArgument,
+    // Identifies a submitted VM, see await
+    using Ticket = std::shared_ptr<internal::Task>;
+
+    // Starts the worker threads, one per core if workers is 0. Every VM is
+    // executed for slice instructions before the next one gets its turn.
+    Scheduler(size_t workers = 0, u64 slice = 4096);
+    Scheduler(Scheduler const&) = delete;
+    Scheduler& operator=(Scheduler const&) = delete;
+    // Stops the workers once their current slice is done. VMs which did not
+    // finish keep their state and can be run again, awaiting them returns
+    // StatusKind::BudgetExhausted.
+    ~Scheduler();
+
+    // Queues the VM. It must not be used or submitted again until await
+    // returned for its ticket.
+    Ticket               submit(VM& vm);
+    // Blocks until the VM halted or failed and returns the status of its
+    // last run
+    Status               await(Ticket const& ticket);
+    size_t               workers() const;
+    // A snapshot of the counters of every worker
+    std::vector<Statistics> statistics() const;
+
+private:
+    std::unique_ptr<internal::SchedulerState> state;
+};
+
+// _X(kind, name, period)
+// name is the name perf uses for the event, period the default amount of
+// events between two samples.
+#define PERF_EVENT                                              \
+    _X(Cycles,       "cycles",                1000003)          \
+    _X(Instructions, "instructions",          1000003)          \
+    _X(BranchMisses, "branch-misses",         10007)            \
+    _X(L1dMisses,    "L1-dcache-load-misses", 10007)            \
+    /* Nanoseconds of the thread, does not need a PMU */        \
+    _X(TaskClock,    "task-clock",            100003)
+
+enum class PerfEvent: u8 {
+#define _X(kind, ...) kind,
+    PERF_EVENT
+#undef _X
+    Last,
+};
+
+char const* perf_event_string(PerfEvent event);
+
+// Samples hardware events with perf_event_open while a VM runs on the
+// thread which called start. Every sample interrupts the thread and is
+// charged to the pc the dispatch loop was at, so it needs a build with
+// RVM_PROFILE and Linux. Only one sampler can be running at a time.
+class PerfSampler {
+public:
+    PerfSampler() = default;
+    PerfSampler(PerfSampler const&) = delete;
+    PerfSampler& operator=(PerfSampler const&) = delete;
+    ~PerfSampler();
+
+    // Opens every event the machine supports and starts sampling. Fails if
+    // none of them could be opened.
+    void start(VM& vm, Error **error);
+    // Stops sampling and reads the totals
+    void stop();
+
+    // The events which could be opened
+    std::vector<PerfEvent> const& events() const;
+    // Count of the event while sampling
+    u64                           total(PerfEvent event) const;
+    // Samples of the event at every pc, the end of the program included
+    std::vector<u64> const&       samples(PerfEvent event) const;
+
+    // Writes the samples as folded stacks for flamegraph.pl, one line per
+    // event and pc:
+    //
+    //   event;kind;pc instruction count
+    //
+    // kind is the dispatched kind, so fused instructions show up as their
+    // superinstruction.
+    void write_folded(FILE *file, Code const& code) const;
+
+private:
+    VM                           *vm = nullptr;
+    std::vector<PerfEvent>        opened{};
+    std::vector<int>              fds{};
+    std::vector<u64>              totals{};
+    std::vector<std::vector<u64>> counts{};
+    bool                          running = false;
+
+    friend struct internal::PerfHandler;
 };
 
 class Error {
@@ -190,11 +1019,16 @@ public:
     Error(ErrorKind kind);
     Error(ErrorKind kind, char const *error_value = "", bool cleanup_error_value = false);
     Error(ErrorKind kind, std::tuple<char const*, bool> error_value = {"", false});
+    // The message is formatted from the status when what is called
+    Error(Status status);
     ErrorKind kind;
     char const *error_value = "";
     bool cleanup_error_value = false;
+    Status status{};
     char const *what();
     ~Error();
+private:
+    std::string message{};
 };
 
 // NOTE: Internal stuff, not public API and not stable
@@ -0,0 +1,254 @@
+// rvm ahead of time compiler
+// Translates a program into a C++ translation unit. Every basic block
+// becomes a label, every stack slot a local variable and every jump a goto.
+// The generated code links against rvm_lib and hands over to the
+// interpreter whenever an instruction would fail or the program ends, so
+// errors and the final stack match the interpreter.
+
+#include "rvm.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+constexpr rvm::u32 unknown_depth = std::numeric_limits<rvm::u32>::max();
+// Deeper programs are interpreted, every slot is a local of one function and
+// compilers give up on functions with too many of them
+constexpr rvm::u64 max_locals = 256;
+
+std::string object_literal(rvm::Object const& object) {
+    if (object.kind == rvm::ObjectKind::Last) {
+        return "rvm::Object()";
+    }
+    return std::format("rvm::Object(rvm::ObjectKind::{}, static_cast<rvm::u64>({}u))", rvm::object_kind_string(object.kind), object.data);
+}
+
+// Writes the locals s0 to s{depth - 1} back to the VM and continues in the
+// interpreter at pc
+std::string leave(rvm::u64 pc, rvm::u64 depth, std::string_view indent = "    ") {
+    std::string out{};
+    for (rvm::u64 i = 0; i < depth; i++) {
+        out += std::format("{}vm.stack[{}] = s{};\n", indent, i, i);
+    }
+    out += std::format("{}vm.stack.count = {};\n", indent, depth);
+    out += std::format("{}vm.pc = {};\n", indent, pc);
+    out += std::format("{}return vm.run();\n", indent);
+    return out;
+}
+
+std::string compile_program(rvm::Code const& code, std::string_view name) {
+    std::string out{};
+    rvm::u64 size = code.size();
+
+    out += "#include <rvm.hpp>\n";
+    out += "#include <memory>\n\n";
+    out += "namespace {\n";
+    out += "rvm::InstructionKind const kinds[] = {\n";
+    for (auto kind : code.kinds) {
+        out += std::format("    rvm::InstructionKind::{},\n", kind == rvm::InstructionKind::Last ? "Last" : rvm::instruction_kind_string(kind));
+    }
+    out += "};\n";
+    out += "rvm::u32 const arguments[] = {\n";
+    for (auto argument : code.arguments) {
+        out += std::format("    {},\n", argument);
+    }
+    out += "};\n";
+    out += "rvm::Object const constants[] = {\n";
+    for (auto const& constant : code.constants) {
+        out += std::format("    {},\n", object_literal(constant));
+    }
+    out += "};\n";
+    out += "}\n\n";
+
+    out += "// The interpreted program, the VM passed to the compiled function has to be\n";
+    out += "// created from it\n";
+    out += std::format("rvm::Code {}_code() {{\n", name);
+    out += "    // The arrays are static, nothing to free\n";
+    out += "    return rvm::Code(kinds, arguments, constants, std::shared_ptr<void const>(kinds, [](void const*) {}));\n";
+    out += "}\n\n";
+
+    out += std::format("rvm::Status {}(rvm::VM& vm) {{\n", name);
+    if (!code.stack_depth_known || code.max_stack_depth > max_locals) {
+        // Dynamic jumps or too deep, nothing to compile
+        out += "    return vm.run();\n";
+        out += "}\n";
+        return out;
+    }
+
+    out += "    if (vm.pc != 0 || vm.stack.size() != 0) {\n";
+    out += "        return vm.run();\n";
+    out += "    }\n";
+    out += std::format("    vm.stack.reserve({});\n", code.max_stack_depth);
+    for (rvm::u64 i = 0; i < code.max_stack_depth; i++) {
+        out += std::format("    [[maybe_unused]] rvm::Object s{};\n", i);
+    }
+    out += "\n";
+
+    // Only blocks which are the target of a reachable jump need a label
+    rvm::CFG cfg{code};
+    std::vector<bool> labels(cfg.blocks.size(), false);
+    for (auto const& block : cfg.blocks) {
+        auto kind = code.kinds[block.end - 1];
+        if (block.reachable && (kind == rvm::InstructionKind::Jmp || kind == rvm::InstructionKind::JmpIf)
+            && code.operand(block.end - 1)->data < size) {
+            labels[cfg.block(code.operand(block.end - 1)->data)] = true;
+        }
+    }
+
+    // Returns the statements leaving the block for target with depth values
+    auto jump = [&](rvm::u64 target, rvm::u64 depth, std::string_view indent) {
+        if (target >= size) {
+            return leave(size, depth, indent);
+        }
+        return std::format("{}goto pc_{};\n", indent, target);
+    };
+
+    rvm::u64 depth = 0;
+    for (rvm::u32 i = 0; i < cfg.blocks.size(); i++) {
+        auto const& block = cfg.blocks[i];
+        if (!block.reachable) {
+            if (block.end - block.begin == 1) {
+                out += std::format("    // {} is unreachable\n", block.begin);
+            } else {
+                out += std::format("    // {} to {} are unreachable\n", block.begin, block.end - 1);
+            }
+            continue;
+        }
+        if (labels[i]) {
+            out += std::format("pc_{}:\n", block.begin);
+        }
+
+        depth = code.stack_depths[block.begin];
+        for (rvm::u64 pc = block.begin; pc < block.end; pc++) {
+            auto kind = code.kinds[pc];
+            out += std::format("    // {}: {}\n", pc, code.instruction(pc).string());
+            switch (kind) {
+                case rvm::InstructionKind::Nop:
+                    break;
+                case rvm::InstructionKind::Push:
+                    out += std::format("    s{} = {};\n", depth, object_literal(*code.operand(pc)));
+                    break;
+                case rvm::InstructionKind::Add:
+                case rvm::InstructionKind::Sub: {
+                    rvm::u64 lhs = depth - 2;
+                    rvm::u64 rhs = depth - 1;
+                    out += std::format("    if (s{}.kind != s{}.kind || s{}.kind == rvm::ObjectKind::Bool) [[unlikely]] {{\n", lhs, rhs, lhs);
+                    out += leave(pc, depth, "        ");
+                    out += "    }\n";
+                    out += std::format("    s{}.data {}= s{}.data;\n", lhs, kind == rvm::InstructionKind::Add ? '+' : '-', rhs);
+                    break;
+                }
+                case rvm::InstructionKind::Jmp:
+                    out += jump(code.operand(pc)->data, depth, "    ");
+                    break;
+                case rvm::InstructionKind::JmpIf: {
+                    rvm::u64 cond = depth - 1;
+                    out += std::format("    if (s{}.kind != rvm::ObjectKind::Bool) [[unlikely]] {{\n", cond);
+                    out += leave(pc, depth, "        ");
+                    out += "    }\n";
+                    out += std::format("    if (s{}.data != 0) {{\n", cond);
+                    out += jump(code.operand(pc)->data, depth - 1, "        ");
+                    out += "    }\n";
+                    break;
+                }
+                default:
+                    // Executed by the interpreter
+                    out += leave(pc, depth);
+                    break;
+            }
+            depth = depth - rvm::instruction_pops(kind) + rvm::instruction_pushes(kind);
+        }
+    }
+
+    out += leave(size, size > 0 && code.stack_depths[size - 1] != unknown_depth ? depth : 0);
+    out += "}\n";
+    return out;
+}
+
+std::string compile_main(std::string_view name) {
+    std::string out = "\n#include <iostream>\n\n";
+    out += "int main() {\n";
+    out += std::format("    rvm::VM vm{{{}_code()}};\n", name);
+    out += std::format("    auto status = {}(vm);\n", name);
+    out += "    if (status.kind == rvm::StatusKind::Error) {\n";
+    out += "        std::cerr << \"ERROR: \" << status.what() << std::endl;\n";
+    out += "    }\n\n";
+    out += "    for (size_t i = 0; i < vm.stack.size(); i++) {\n";
+    out += "        std::cout << vm.stack[i].string() << \"\\n\";\n";
+    out += "    }\n";
+    out += "    return status.kind == rvm::StatusKind::Halt ? 0 : 1;\n";
+    out += "}\n";
+    return out;
+}
+
+int main(int argc, char **argv) {
+    std::vector<char*> args = std::vector<char*>(argv, argv + argc);
+
+    bool with_main = false;
+    std::string name = "rvm_program";
+    std::vector<char*> paths{};
+    for (size_t i = 1; i < args.size(); i++) {
+        std::string_view arg = args[i];
+        if (arg == "--main") {
+            with_main = true;
+        } else if (arg == "--name" && i + 1 < args.size()) {
+            name = args[++i];
+        } else {
+            paths.push_back(args[i]);
+        }
+    }
+
+    if (paths.empty() || paths.size() > 2) {
+        std::cerr << "ERROR: rvm-aot requires an input file\n";
+        std::cerr << "usage: rvm-aot [--main] [--name <function>] <input> [<output>]\n";
+        return 1;
+    }
+
+    rvm::Error *error = nullptr;
+    defer(if (error != nullptr) { delete error; });
+    rvm::ObjectArena arena{};
+    auto bytecode = rvm::bytecode_from_file(paths[0], arena, &error);
+    if (error != nullptr) {
+        std::cerr << "ERROR: " << error->what() << std::endl;
+        return 2;
+    }
+
+    rvm::Code code{bytecode};
+    code.verify(&error);
+    if (error != nullptr) {
+        std::cerr << "ERROR: " << error->what() << std::endl;
+        return 2;
+    }
+    code.analyze_stack();
+    if (!code.stack_depth_known) {
+        std::cerr << "WARNING: the stack depth is not known, the program is interpreted\n";
+    } else if (code.max_stack_depth > max_locals) {
+        std::cerr << "WARNING: the stack is deeper than " << max_locals << " values, the program is interpreted\n";
+    }
+
+    std::string out = std::format("// Generated by rvm-aot from {}, do not edit\n", paths[0]);
+    out += compile_program(code, name);
+    if (with_main) {
+        out += compile_main(name);
+    }
+
+    FILE *file = paths.size() > 1 ? fopen(paths[1], "w") : stdout;
+    if (file == nullptr) {
+        std::cerr << "ERROR: could not open " << paths[1] << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    bool written = fwrite(out.data(), 1, out.size(), file) == out.size();
+    if (file != stdout) {
+        written = fclose(file) == 0 && written;
+    }
+    if (!written) {
+        std::cerr << "ERROR: failed to write the output: " << strerror(errno) << std::endl;
+        return 2;
+    }
+    return 0;
+}
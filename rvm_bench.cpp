@@ -0,0 +1,490 @@
+// rvm benchmarks
+// Generates a corpus of programs and measures how fast they are executed
+// and loaded. Every benchmark is repeated and the fastest run is reported,
+// the results can be written as JSON and compared against an earlier run.
+// Execution is counted in instructions actually executed, taken from the
+// fuel VM::run_for reports, so skipped and repeated code is accounted for.
+// The stack and the register engine also report how often they dispatch,
+// see VM::run_counting, and how many dispatches the register code saves.
+
+#include "rvm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+struct Result {
+    std::string name;
+    // Instructions executed or loaded per repetition
+    rvm::u64    instructions = 0;
+    // Bytes loaded per repetition, 0 for execution benchmarks
+    rvm::u64    bytes = 0;
+    // Fastest repetition
+    double      seconds = 0;
+    // Peak resident set size during the benchmark, see reset_peak_rss
+    rvm::u64    peak_rss_kb = 0;
+    // Dispatches per repetition counted by VM::run_counting, 0 if not
+    // counted. saved_dispatches compares the register engine to the stack
+    // engine running the same program, it is negative if the register code
+    // dispatches more.
+    rvm::u64    dispatches = 0;
+    std::optional<int64_t> saved_dispatches{};
+
+    double instructions_per_second() const {
+        return seconds > 0 ? static_cast<double>(instructions) / seconds : 0;
+    }
+
+    double ns_per_instruction() const {
+        return instructions > 0 ? seconds * 1e9 / static_cast<double>(instructions) : 0;
+    }
+
+    double mb_per_second() const {
+        return seconds > 0 ? static_cast<double>(bytes) / seconds / 1e6 : 0;
+    }
+
+    // The number compared against the baseline, lower is better
+    double metric() const {
+        return bytes > 0 ? seconds * 1e9 / static_cast<double>(bytes) : ns_per_instruction();
+    }
+};
+
+struct Options {
+    int         repeat = 5;
+    // Divides the size of every program, for quick runs
+    rvm::u64    scale = 1;
+    std::string filter{};
+    char const *json_path = nullptr;
+    char const *baseline_path = nullptr;
+    // Allowed slowdown against the baseline in percent
+    double      threshold = 10;
+};
+
+// Makes peak_rss_kb report the peak since this call. Only Linux can reset
+// the peak, elsewhere it stays the peak of the whole process.
+bool reset_peak_rss() {
+#if defined(__linux__)
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+    if (file == nullptr) {
+        return false;
+    }
+    bool reset = fputs("5", file) >= 0;
+    return fclose(file) == 0 && reset;
+#else
+    return false;
+#endif
+}
+
+rvm::u64 peak_rss_kb() {
+#if defined(__linux__)
+    // VmHWM is reset by reset_peak_rss, ru_maxrss is not
+    FILE *file = fopen("/proc/self/status", "r");
+    if (file != nullptr) {
+        defer(fclose(file));
+        char line[256];
+        while (fgets(line, sizeof line, file) != nullptr) {
+            if (strncmp(line, "VmHWM:", 6) == 0) {
+                return strtoull(line + 6, nullptr, 10);
+            }
+        }
+    }
+#endif
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    // Linux reports kilobytes, macOS bytes
+#if defined(__APPLE__)
+    return static_cast<rvm::u64>(usage.ru_maxrss) / 1024;
+#else
+    return static_cast<rvm::u64>(usage.ru_maxrss);
+#endif
+}
+
+// Runs setup and body repeat times and returns the fastest body in seconds
+double measure(int repeat, std::function<void()> const& setup, std::function<void()> const& body) {
+    double best = 0;
+    for (int i = 0; i < repeat; i++) {
+        setup();
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - start).count();
+        if (i == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    return best;
+}
+
+rvm::Instruction push(rvm::u64 value) {
+    return rvm::Instruction(rvm::InstructionKind::Push, new rvm::Object(rvm::ObjectKind::U64, value));
+}
+
+rvm::Instruction push_bool(bool value) {
+    return rvm::Instruction(rvm::InstructionKind::Push, new rvm::Object(rvm::ObjectKind::Bool, value));
+}
+
+rvm::Instruction jump(rvm::InstructionKind kind, rvm::u64 target) {
+    return rvm::Instruction(kind, new rvm::Object(rvm::ObjectKind::U64, target));
+}
+
+// counter = counter op 1 forever
+std::vector<rvm::Instruction> tight_loop(rvm::InstructionKind op) {
+    return {
+        push(1000000),
+        push(1),
+        rvm::Instruction(op),
+        push_bool(true),
+        jump(rvm::InstructionKind::JmpIf, 1),
+    };
+}
+
+// tight_loop unrolled iterations times. Every iteration still ends with the
+// taken JmpIf of tight_loop, to the next iteration, and the last one
+// leaves the program, so it can be run to the end by every engine.
+std::vector<rvm::Instruction> counted_loop(rvm::InstructionKind op, rvm::u64 iterations) {
+    std::vector<rvm::Instruction> instructions{push(1000000)};
+    instructions.reserve(iterations * 4 + 1);
+    for (rvm::u64 i = 0; i < iterations; i++) {
+        instructions.push_back(push(1));
+        instructions.push_back(rvm::Instruction(op));
+        instructions.push_back(push_bool(true));
+        instructions.push_back(jump(rvm::InstructionKind::JmpIf, instructions.size() + 1));
+    }
+    return instructions;
+}
+
+// states blocks, every block jumps to the next state of a shuffled cycle
+// through all of them, so the targets are hard to predict. A counted state
+// machine leaves the program after the last state instead of starting the
+// cycle again, after visiting every state once.
+std::vector<rvm::Instruction> state_machine(rvm::u64 states, bool counted = false) {
+    std::vector<rvm::u64> order(states);
+    for (rvm::u64 i = 0; i < states; i++) {
+        order[i] = i;
+    }
+    rvm::u64 seed = 0x9E3779B97F4A7C15;
+    for (rvm::u64 i = states - 1; i > 0; i--) {
+        seed = seed * 6364136223846793005 + 1442695040888963407;
+        std::swap(order[i], order[(seed >> 33) % (i + 1)]);
+    }
+
+    // A state is Push true; JmpIf next
+    std::vector<rvm::u64> next(states);
+    for (rvm::u64 i = 0; i < states; i++) {
+        next[order[i]] = order[(i + 1) % states];
+    }
+    if (counted) {
+        // The cycle starts at state 0, which is entered first
+        auto last = std::find(order.begin(), order.end(), 0);
+        next[last == order.begin() ? order.back() : *(last - 1)] = states;
+    }
+    std::vector<rvm::Instruction> instructions{};
+    instructions.reserve(states * 2);
+    for (rvm::u64 state = 0; state < states; state++) {
+        instructions.push_back(push_bool(true));
+        instructions.push_back(jump(rvm::InstructionKind::JmpIf, next[state] * 2));
+    }
+    return instructions;
+}
+
+// Pushes depth values and adds them all up
+std::vector<rvm::Instruction> deep_stack(rvm::u64 depth) {
+    std::vector<rvm::Instruction> instructions{};
+    instructions.reserve(depth * 2);
+    for (rvm::u64 i = 0; i < depth; i++) {
+        instructions.push_back(push(i));
+    }
+    for (rvm::u64 i = 1; i < depth; i++) {
+        instructions.push_back(rvm::Instruction(rvm::InstructionKind::Add));
+    }
+    return instructions;
+}
+
+// counter + 1 - 1 + 1 ... without a single jump
+std::vector<rvm::Instruction> straight_line(rvm::u64 pairs) {
+    std::vector<rvm::Instruction> instructions{push(0)};
+    instructions.reserve(pairs * 2 + 1);
+    for (rvm::u64 i = 0; i < pairs; i++) {
+        instructions.push_back(push(1));
+        instructions.push_back(rvm::Instruction(i % 2 == 0 ? rvm::InstructionKind::Add : rvm::InstructionKind::Sub));
+    }
+    return instructions;
+}
+
+// Resumes looping programs for budget instructions
+Result bench_loop(std::string name, std::vector<rvm::Instruction> const& instructions, rvm::u64 budget, Options const& options) {
+    rvm::VM vm{instructions};
+    // Whole blocks are executed, so slightly more than budget
+    rvm::u64 executed = 0;
+    double seconds = measure(options.repeat, [&] {
+        vm.pc = 0;
+        vm.stack.count = 0;
+    }, [&] {
+        executed = vm.run_for(budget).operand;
+    });
+    return Result{name, executed, 0, seconds, peak_rss_kb()};
+}
+
+// Runs terminating programs to the end with the selected engine, runs times
+// per repetition
+Result bench_run(std::string name, std::vector<rvm::Instruction> const& instructions, std::string_view engine, rvm::u64 runs, Options const& options) {
+    rvm::Program program{instructions};
+    if (engine == "jit") {
+        program.edit().compile();
+    } else if (engine == "registers") {
+        // Before the VMs share the program, so it is translated once
+        program.edit().translate();
+    }
+    rvm::VM vm{program};
+    if (engine == "registers") {
+        vm.select(rvm::Engine::Register);
+    }
+
+    // run does not count, so the instructions are counted by an untimed
+    // run_for of the same program
+    rvm::VM counter{program};
+    rvm::u64 executed = counter.run_for(std::numeric_limits<rvm::u64>::max()).operand * runs;
+
+    // The native code does not dispatch
+    rvm::u64 dispatches = 0;
+    std::optional<int64_t> saved{};
+    if (engine != "jit") {
+        rvm::VM counting{program};
+        counting.engine = vm.engine;
+        counting.run_counting(&dispatches);
+        if (engine == "registers") {
+            rvm::u64 stack_dispatches = 0;
+            rvm::VM stack{program};
+            stack.run_counting(&stack_dispatches);
+            saved = static_cast<int64_t>(stack_dispatches - dispatches) * static_cast<int64_t>(runs);
+        }
+        dispatches *= runs;
+    }
+
+    double seconds = measure(options.repeat, [] {}, [&] {
+        for (rvm::u64 i = 0; i < runs; i++) {
+            vm.pc = 0;
+            vm.stack.count = 0;
+            vm.run();
+        }
+    });
+    return Result{std::format("{}/{}", name, engine), executed, 0, seconds, peak_rss_kb(), dispatches, saved};
+}
+
+std::optional<Result> bench_load(std::string name, std::vector<rvm::Instruction> const& instructions, std::string_view format, Options const& options) {
+    char path[] = "/tmp/rvm-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        std::cerr << "ERROR: could not create a temporary file: " << strerror(errno) << std::endl;
+        return std::nullopt;
+    }
+    FILE *file = fdopen(fd, "wb");
+    rvm::Error *error = nullptr;
+    defer(if (error != nullptr) { delete error; });
+    defer(remove(path));
+
+    if (format == "raw") {
+        for (auto instruction : instructions) {
+            instruction.write(file, &error);
+            if (error != nullptr) {
+                break;
+            }
+        }
+    } else if (format == "varint") {
+        rvm::write_code(file, rvm::Code(instructions), rvm::Encoding::Varint, &error);
+    } else {
+        rvm::write_bytecode(file, instructions, &error);
+    }
+    rvm::u64 bytes = static_cast<rvm::u64>(ftell(file));
+    fclose(file);
+    if (error != nullptr) {
+        std::cerr << "ERROR: " << error->what() << std::endl;
+        return std::nullopt;
+    }
+
+    // Every format ends with a verified program, ready to run
+    double seconds = measure(options.repeat, [] {}, [&] {
+        if (format == "raw" || format == "container") {
+            rvm::ObjectArena arena{};
+            rvm::Program program{rvm::bytecode_from_file(path, arena, &error)};
+        } else {
+            rvm::Program program{rvm::code_from_file(path, &error)};
+        }
+    });
+    if (error != nullptr) {
+        std::cerr << "ERROR: " << error->what() << std::endl;
+        return std::nullopt;
+    }
+    return Result{std::format("{}/{}", name, format), instructions.size(), bytes, seconds, peak_rss_kb()};
+}
+
+std::string results_json(std::vector<Result> const& results) {
+    // One benchmark per line, read_baseline depends on it
+    std::string out = "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        auto const& result = results[i];
+        out += std::format("    {{\"name\": \"{}\", \"instructions\": {}, \"bytes\": {}, \"seconds\": {:.9f}, "
+                           "\"instructions_per_second\": {:.0f}, \"ns_per_instruction\": {:.4f}, \"mb_per_second\": {:.2f}, "
+                           "\"peak_rss_kb\": {}, \"dispatches\": {}, \"saved_dispatches\": {}, \"metric\": {:.6f}}}{}\n",
+                           result.name, result.instructions, result.bytes, result.seconds,
+                           result.instructions_per_second(), result.ns_per_instruction(), result.mb_per_second(),
+                           result.peak_rss_kb, result.dispatches,
+                           result.saved_dispatches.has_value() ? std::format("{}", *result.saved_dispatches) : "null", result.metric(),
+                           i + 1 < results.size() ? "," : "");
+    }
+    out += "  ]\n}\n";
+    return out;
+}
+
+// Reads the name and metric of every benchmark in a file written by
+// results_json
+std::vector<std::pair<std::string, double>> read_baseline(char const *path, bool *ok) {
+    std::vector<std::pair<std::string, double>> baseline{};
+    FILE *file = fopen(path, "r");
+    *ok = file != nullptr;
+    if (file == nullptr) {
+        return baseline;
+    }
+    defer(fclose(file));
+
+    char buffer[1024];
+    while (fgets(buffer, sizeof buffer, file) != nullptr) {
+        std::string_view line = buffer;
+        constexpr std::string_view name_key = "\"name\": \"";
+        constexpr std::string_view metric_key = "\"metric\": ";
+        auto name = line.find(name_key);
+        auto metric = line.find(metric_key);
+        if (name == std::string_view::npos || metric == std::string_view::npos) {
+            continue;
+        }
+        name += name_key.size();
+        auto name_end = line.find('"', name);
+        if (name_end == std::string_view::npos) {
+            continue;
+        }
+        baseline.push_back({std::string(line.substr(name, name_end - name)), strtod(buffer + metric + metric_key.size(), nullptr)});
+    }
+    return baseline;
+}
+
+int main(int argc, char **argv) {
+    std::vector<char*> args = std::vector<char*>(argv, argv + argc);
+
+    Options options{};
+    for (size_t i = 1; i < args.size(); i++) {
+        std::string_view arg = args[i];
+        if (arg == "--quick") {
+            options.scale = 20;
+            options.repeat = 2;
+        } else if (arg == "--repeat" && i + 1 < args.size()) {
+            options.repeat = std::max(atoi(args[++i]), 1);
+        } else if (arg == "--filter" && i + 1 < args.size()) {
+            options.filter = args[++i];
+        } else if (arg == "--json" && i + 1 < args.size()) {
+            options.json_path = args[++i];
+        } else if (arg == "--baseline" && i + 1 < args.size()) {
+            options.baseline_path = args[++i];
+        } else if (arg == "--threshold" && i + 1 < args.size()) {
+            options.threshold = strtod(args[++i], nullptr);
+        } else {
+            std::cerr << "usage: rvm-bench [--quick] [--repeat <n>] [--filter <substring>] [--json <file>] [--baseline <file>] [--threshold <percent>]\n";
+            return 1;
+        }
+    }
+
+    rvm::u64 scale = options.scale;
+    std::vector<std::pair<std::string, std::function<std::optional<Result>()>>> benchmarks{
+        {"loop_add", [&] { return bench_loop("loop_add", tight_loop(rvm::InstructionKind::Add), 200000000 / scale, options); }},
+        {"loop_sub", [&] { return bench_loop("loop_sub", tight_loop(rvm::InstructionKind::Sub), 200000000 / scale, options); }},
+        {"state_machine", [&] { return bench_loop("state_machine", state_machine(65536 / scale), 100000000 / scale, options); }},
+    };
+    // Forward jumps every 20 instructions on average, see rvm::generate
+    rvm::GenerateOptions generated{};
+    generated.size = 4000000 / scale;
+    generated.branch_density = 0.1;
+    // The counted loops run about as many instructions as the loops above
+    constexpr rvm::u64 iterations = 1000;
+    constexpr rvm::u64 states = 65536;
+    for (auto engine : {"interpreter", "jit", "registers"}) {
+        benchmarks.push_back({"loop_add_counted", [&, engine] { return bench_run("loop_add_counted", counted_loop(rvm::InstructionKind::Add, iterations), engine, 50000 / scale, options); }});
+        benchmarks.push_back({"loop_sub_counted", [&, engine] { return bench_run("loop_sub_counted", counted_loop(rvm::InstructionKind::Sub, iterations), engine, 50000 / scale, options); }});
+        benchmarks.push_back({"state_machine_counted", [&, engine] { return bench_run("state_machine_counted", state_machine(states / scale, true), engine, 763, options); }});
+        benchmarks.push_back({"deep_stack", [&, engine] { return bench_run("deep_stack", deep_stack(1000000 / scale), engine, 1, options); }});
+        benchmarks.push_back({"straight_line", [&, engine] { return bench_run("straight_line", straight_line(4000000 / scale), engine, 1, options); }});
+        benchmarks.push_back({"generated", [&, engine] { return bench_run("generated", rvm::generate(generated), engine, 1, options); }});
+    }
+    // raw and container decode every instruction, mapped uses the
+    // container in place and varint decodes it into arrays. All of them
+    // verify the program afterwards.
+    for (auto format : {"raw", "container", "mapped", "varint"}) {
+        benchmarks.push_back({"load", [&, format] { return bench_load("load", straight_line(2000000 / scale), format, options); }});
+        benchmarks.push_back({"load_generated", [&, format] { return bench_load("load_generated", rvm::generate(generated), format, options); }});
+    }
+
+    std::vector<Result> results{};
+    std::cout << std::format("{:<36} {:>14} {:>10} {:>10} {:>12} {:>14} {:>14}\n", "benchmark", "instr/s", "ns/instr", "MB/s", "peak RSS kB", "dispatches", "saved");
+    for (auto const& [name, run] : benchmarks) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        reset_peak_rss();
+        auto result = run();
+        if (!result.has_value()) {
+            return 2;
+        }
+        // Only the register engine saves dispatches
+        std::string dispatches = result->dispatches > 0 ? std::format("{}", result->dispatches) : "-";
+        std::string saved = result->saved_dispatches.has_value() ? std::format("{}", *result->saved_dispatches) : "-";
+        std::cout << std::format("{:<36} {:>14.0f} {:>10.3f} {:>10.1f} {:>12} {:>14} {:>14}\n", result->name,
+                                 result->instructions_per_second(), result->ns_per_instruction(),
+                                 result->mb_per_second(), result->peak_rss_kb, dispatches, saved);
+        results.push_back(*result);
+    }
+
+    if (options.json_path != nullptr) {
+        std::string json = results_json(results);
+        FILE *file = fopen(options.json_path, "w");
+        if (file == nullptr || fwrite(json.data(), 1, json.size(), file) != json.size()) {
+            std::cerr << "ERROR: could not write " << options.json_path << ": " << strerror(errno) << std::endl;
+            return 2;
+        }
+        fclose(file);
+    }
+
+    if (options.baseline_path == nullptr) {
+        return 0;
+    }
+
+    bool ok = false;
+    auto baseline = read_baseline(options.baseline_path, &ok);
+    if (!ok) {
+        std::cerr << "ERROR: could not read " << options.baseline_path << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+
+    // The metric is time per instruction or byte, so a positive change is a
+    // slowdown
+    bool regressed = false;
+    std::cout << std::format("\n{:<36} {:>12} {:>12} {:>9}\n", "against baseline", "baseline", "now", "change");
+    for (auto const& result : results) {
+        auto old = std::find_if(baseline.begin(), baseline.end(), [&](auto const& entry) { return entry.first == result.name; });
+        if (old == baseline.end() || old->second <= 0) {
+            continue;
+        }
+        double change = (result.metric() / old->second - 1) * 100;
+        bool slower = change > options.threshold;
+        regressed = regressed || slower;
+        std::cout << std::format("{:<36} {:>12.4f} {:>12.4f} {:>+8.1f}%{}\n", result.name, old->second, result.metric(), change, slower ? " REGRESSION" : "");
+    }
+    return regressed ? 3 : 0;
+}
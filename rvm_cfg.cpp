@@ -0,0 +1,251 @@
+#include "rvm.hpp"
+#include <utility>
+#include <vector>
+
+namespace rvm {
+
+CFG::CFG(std::vector<Instruction> const& bytecode) {
+    u64 size = bytecode.size();
+    build(size,
+          [&](u64 pc) { return bytecode[pc].kind; },
+          [&](u64 pc) { return bytecode[pc].value != nullptr ? bytecode[pc].value->data : size; });
+}
+
+CFG::CFG(Code const& code) {
+    u64 size = code.size();
+    build(size,
+          [&](u64 pc) { return code.kinds[pc]; },
+          [&](u64 pc) { return code.operand(pc) != nullptr ? code.operand(pc)->data : size; });
+}
+
+u32 CFG::block(u64 pc) const {
+    return pc < block_of.size() ? block_of[pc] : none;
+}
+
+bool CFG::dominates(u32 a, u32 b) const {
+    if (a >= blocks.size() || b >= blocks.size() || !blocks[a].reachable || !blocks[b].reachable) {
+        return false;
+    }
+    return dominator_enter[a] <= dominator_enter[b] && dominator_leave[b] <= dominator_leave[a];
+}
+
+template <class Kind, class Target>
+void CFG::build(u64 size, Kind kind, Target target) {
+    if (size == 0) {
+        return;
+    }
+
+    // Mark the first instruction of every block
+    std::vector<bool> leaders(size, false);
+    leaders[0] = true;
+    for (u64 pc = 0; pc < size; pc++) {
+        switch (kind(pc)) {
+            case InstructionKind::Jmp:
+            case InstructionKind::JmpIf:
+                if (target(pc) < size) {
+                    leaders[target(pc)] = true;
+                }
+                [[fallthrough]];
+            case InstructionKind::JmpO:
+            case InstructionKind::JmpIfO:
+                dynamic_jumps = dynamic_jumps || kind(pc) == InstructionKind::JmpO || kind(pc) == InstructionKind::JmpIfO;
+                if (pc + 1 < size) {
+                    leaders[pc + 1] = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    block_of.resize(size);
+    for (u64 pc = 0; pc < size; pc++) {
+        if (leaders[pc]) {
+            if (!blocks.empty()) {
+                blocks.back().end = pc;
+            }
+            blocks.push_back(BasicBlock{pc, size});
+        }
+        block_of[pc] = blocks.size() - 1;
+    }
+
+    auto edge = [&](u32 from, u64 to) {
+        if (to < size) {
+            blocks[from].successors.push_back(block_of[to]);
+            blocks[block_of[to]].predecessors.push_back(from);
+        }
+    };
+
+    for (u32 i = 0; i < blocks.size(); i++) {
+        u64 last = blocks[i].end - 1;
+        switch (kind(last)) {
+            case InstructionKind::Jmp:
+                edge(i, target(last));
+                break;
+            case InstructionKind::JmpIf:
+                edge(i, target(last));
+                // Both edges lead to the same block when jumping to the next instruction
+                if (target(last) != last + 1) {
+                    edge(i, last + 1);
+                }
+                break;
+            case InstructionKind::JmpO:
+                break;
+            default:
+                edge(i, last + 1);
+                break;
+        }
+    }
+
+    // Reachability through static edges, with an explicit worklist so big
+    // programs do not overflow the call stack
+    std::vector<u32> worklist{0};
+    blocks[0].reachable = true;
+    while (!worklist.empty()) {
+        u32 current = worklist.back();
+        worklist.pop_back();
+        for (u32 successor : blocks[current].successors) {
+            if (!blocks[successor].reachable) {
+                blocks[successor].reachable = true;
+                worklist.push_back(successor);
+            }
+        }
+    }
+    for (auto& block : blocks) {
+        block.dynamic = !block.reachable && dynamic_jumps;
+    }
+
+    compute_dominators();
+}
+
+// Lengauer-Tarjan with path compression, see "A fast algorithm for finding
+// dominators in a flowgraph". This is the simple version, which links
+// without balancing the trees of the forest. It takes O(m log n) instead of
+// the near-linear time of the balanced one, but is usually faster in
+// practice. All recursion is replaced by explicit stacks.
+void CFG::compute_dominators() {
+    u32 count = blocks.size();
+    std::vector<u32> number(count, none);
+    std::vector<u32> vertex{};
+    std::vector<u32> parent(count, none);
+    std::vector<u32> semi(count, none);
+    std::vector<u32> label(count);
+    std::vector<u32> ancestor(count, none);
+    std::vector<u32> idom(count, none);
+    // Buckets as linked lists, bucket_next links the blocks in a bucket
+    std::vector<u32> bucket(count, none);
+    std::vector<u32> bucket_next(count, none);
+    vertex.reserve(count);
+
+    // Depth first numbering from the entry
+    std::vector<std::pair<u32, u32>> stack{{0, 0}};
+    number[0] = 0;
+    vertex.push_back(0);
+    while (!stack.empty()) {
+        auto& [current, next] = stack.back();
+        if (next == blocks[current].successors.size()) {
+            stack.pop_back();
+            continue;
+        }
+
+        u32 successor = blocks[current].successors[next++];
+        if (number[successor] == none) {
+            number[successor] = vertex.size();
+            vertex.push_back(successor);
+            parent[successor] = current;
+            stack.push_back({successor, 0});
+        }
+    }
+
+    for (u32 v : vertex) {
+        semi[v] = number[v];
+        label[v] = v;
+    }
+
+    std::vector<u32> path{};
+    auto eval = [&](u32 v) {
+        if (ancestor[v] == none) {
+            return v;
+        }
+
+        // Compress the path from v to the root of its tree in the forest
+        u32 current = v;
+        while (ancestor[ancestor[current]] != none) {
+            path.push_back(current);
+            current = ancestor[current];
+        }
+        while (!path.empty()) {
+            u32 w = path.back();
+            path.pop_back();
+            if (semi[label[ancestor[w]]] < semi[label[w]]) {
+                label[w] = label[ancestor[w]];
+            }
+            ancestor[w] = ancestor[ancestor[w]];
+        }
+        return label[v];
+    };
+
+    for (u32 i = vertex.size() - 1; i > 0; i--) {
+        u32 w = vertex[i];
+        for (u32 v : blocks[w].predecessors) {
+            if (number[v] == none) {
+                continue;
+            }
+            u32 u = eval(v);
+            if (semi[u] < semi[w]) {
+                semi[w] = semi[u];
+            }
+        }
+        bucket_next[w] = bucket[vertex[semi[w]]];
+        bucket[vertex[semi[w]]] = w;
+        ancestor[w] = parent[w];
+
+        for (u32 v = bucket[parent[w]]; v != none; v = bucket_next[v]) {
+            u32 u = eval(v);
+            idom[v] = semi[u] < semi[v] ? u : parent[w];
+        }
+        bucket[parent[w]] = none;
+    }
+
+    for (u32 i = 1; i < vertex.size(); i++) {
+        u32 w = vertex[i];
+        if (idom[w] != vertex[semi[w]]) {
+            idom[w] = idom[idom[w]];
+        }
+    }
+
+    // Number the dominator tree, so dominates is a constant time check. The
+    // children of a block are a linked list, reusing the bucket arrays.
+    std::vector<u32>& first_child = bucket;
+    std::vector<u32>& next_sibling = bucket_next;
+    first_child.assign(count, none);
+    for (u32 i = 1; i < vertex.size(); i++) {
+        next_sibling[vertex[i]] = first_child[idom[vertex[i]]];
+        first_child[idom[vertex[i]]] = vertex[i];
+    }
+    dominator_enter.assign(count, none);
+    dominator_leave.assign(count, none);
+    u32 clock = 0;
+    // The block and its next child to visit
+    stack.assign({{0, first_child[0]}});
+    dominator_enter[0] = clock++;
+    while (!stack.empty()) {
+        auto& [current, child] = stack.back();
+        if (child == none) {
+            dominator_leave[current] = clock++;
+            stack.pop_back();
+            continue;
+        }
+
+        u32 visit = child;
+        child = next_sibling[child];
+        dominator_enter[visit] = clock++;
+        stack.push_back({visit, first_child[visit]});
+    }
+
+    for (u32 i = 0; i < count; i++) {
+        blocks[i].immediate_dominator = idom[i];
+    }
+}
+
+}
@@ -0,0 +1,579 @@
+#include "rvm.hpp"
+#include "rvm_internal.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace rvm {
+
+namespace {
+
+constexpr char magic[4] = {'R', 'V', 'M', 'B'};
+constexpr u16  version = 1;
+constexpr u64  section_alignment = 64;
+
+// Header flags
+constexpr u16  flag_varint = 1 << 0;
+
+enum class SectionKind: u32 {
+    Kinds     = 1,
+    Arguments = 2,
+    Constants = 3,
+    // flag_varint only, see encode_varint
+    VarintCode      = 4,
+    VarintConstants = 5,
+};
+
+struct FileHeader {
+    char magic[4];
+    u16  version;
+    u16  flags;
+    u32  section_count;
+    u32  reserved;
+};
+
+struct SectionHeader {
+    SectionKind kind;
+    u32         reserved;
+    u64         offset;
+    u64         size;
+};
+
+static_assert(sizeof(FileHeader) == 16);
+static_assert(sizeof(SectionHeader) == 24);
+static_assert(offsetof(Object, kind) == 0 && offsetof(Object, data) == 8, "the constant section stores Objects as they are laid out in memory");
+
+struct ContainerView {
+    u16                              flags;
+    std::span<InstructionKind const> kinds;
+    std::span<u32 const>             arguments;
+    std::span<Object const>          constants;
+    // With flag_varint, until decode_varint replaces them with arguments
+    // and constants
+    std::span<u8 const>              varint_code;
+    std::span<u8 const>              varint_constants;
+
+    // Returns nullptr if the instruction at pc has no argument
+    Object const* operand(u64 pc) const {
+        Object const& value = constants[arguments[pc]];
+        return value.kind == ObjectKind::Last ? nullptr : &value;
+    }
+};
+
+u64 align(u64 offset) {
+    return (offset + section_alignment - 1) / section_alignment * section_alignment;
+}
+
+bool is_container(u8 const *data, u64 size) {
+    return size >= sizeof magic && memcmp(data, magic, sizeof magic) == 0;
+}
+
+void container_error(Error **error, std::string message) {
+    *error = new Error(ErrorKind::InvalidContainer, strdup(message.c_str()), true);
+}
+
+// Checks the header and the section table and returns views into data. data
+// has to be aligned for Objects.
+ContainerView parse_container(u8 const *data, u64 size, Error **error) {
+    ContainerView view{};
+    FileHeader header;
+
+    if (size < sizeof header) {
+        container_error(error, "file is too small for a container header");
+        return view;
+    }
+    memcpy(&header, data, sizeof header);
+
+    if (memcmp(header.magic, magic, sizeof magic) != 0) {
+        container_error(error, "the file does not start with the container magic number RVMB");
+        return view;
+    }
+    if (header.version != version) {
+        container_error(error, std::format("unsupported container version {}, expected {}", header.version, version));
+        return view;
+    }
+    view.flags = header.flags;
+
+    if (header.section_count > (size - sizeof header) / sizeof(SectionHeader)) {
+        container_error(error, std::format("section table with {} sections does not fit into the file", header.section_count));
+        return view;
+    }
+
+    bool found_kinds = false;
+    bool found_arguments = false;
+    bool found_constants = false;
+    bool found_varint_code = false;
+    bool found_varint_constants = false;
+
+    for (u32 i = 0; i < header.section_count; i++) {
+        SectionHeader section;
+        memcpy(&section, data + sizeof header + i * sizeof section, sizeof section);
+
+        if (section.offset > size || section.size > size - section.offset) {
+            container_error(error, std::format("section {} is outside of the file", i));
+            return view;
+        }
+        if (section.offset % section_alignment != 0) {
+            container_error(error, std::format("section {} is not aligned to {} bytes", i, section_alignment));
+            return view;
+        }
+
+        switch (section.kind) {
+            case SectionKind::Kinds:
+                view.kinds = {reinterpret_cast<InstructionKind const*>(data + section.offset), section.size};
+                found_kinds = true;
+                break;
+            case SectionKind::Constants:
+                if (section.size % sizeof(Object) != 0) {
+                    container_error(error, "the size of the constant section is not a multiple of the object size");
+                    return view;
+                }
+                view.constants = {reinterpret_cast<Object const*>(data + section.offset), section.size / sizeof(Object)};
+                found_constants = true;
+                break;
+            case SectionKind::Arguments:
+                if (section.size % sizeof(u32) != 0) {
+                    container_error(error, "the size of the argument section is not a multiple of 4");
+                    return view;
+                }
+                view.arguments = {reinterpret_cast<u32 const*>(data + section.offset), section.size / sizeof(u32)};
+                found_arguments = true;
+                break;
+            case SectionKind::VarintCode:
+                view.varint_code = {data + section.offset, section.size};
+                found_varint_code = true;
+                break;
+            case SectionKind::VarintConstants:
+                view.varint_constants = {data + section.offset, section.size};
+                found_varint_constants = true;
+                break;
+            default:
+                // Unknown sections are skipped, so newer writers can add some
+                break;
+        }
+    }
+
+    if ((view.flags & flag_varint) != 0) {
+        if (!found_varint_code || !found_varint_constants) {
+            container_error(error, "a varint container requires a code and a constant section");
+        }
+        return view;
+    }
+
+    if (!found_kinds || view.kinds.empty() || view.kinds.back() != InstructionKind::Last) {
+        container_error(error, "the container requires a kinds section, which ends with the end marker");
+        return view;
+    }
+    u64 count = view.kinds.size() - 1;
+
+    if (!found_arguments || view.arguments.size() != count) {
+        container_error(error, std::format("expected an argument section with {} arguments", count));
+        return view;
+    }
+    if (!found_constants || view.constants.empty() || view.constants[0].kind != ObjectKind::Last) {
+        container_error(error, "the constant section has to start with the empty constant");
+        return view;
+    }
+    for (u64 pc = 0; pc < count; pc++) {
+        if (view.arguments[pc] >= view.constants.size()) {
+            container_error(error, std::format("instruction {} refers to constant {}, but there are only {}", pc, view.arguments[pc], view.constants.size()));
+            return view;
+        }
+    }
+
+    return view;
+}
+
+// Decodes every instruction of the container, the operands are allocated in
+// arena or with new if arena is nullptr
+std::vector<Instruction> container_instructions(ContainerView const& view, ObjectArena *arena, Error **error) {
+    std::vector<Instruction> instructions{};
+    instructions.reserve(view.kinds.size() - 1);
+
+    for (u64 pc = 0; pc < view.kinds.size() - 1; pc++) {
+        Object const *value = view.operand(pc);
+        Status status = validate_instruction(view.kinds[pc], value);
+        if (!status.ok()) {
+            container_error(error, std::format("instruction {}: {}", pc, status.what()));
+            return instructions;
+        }
+
+        if (value == nullptr) {
+            instructions.push_back(Instruction(view.kinds[pc]));
+        } else if (arena != nullptr) {
+            instructions.push_back(arena->instruction(view.kinds[pc], *value));
+        } else {
+            instructions.push_back(Instruction(view.kinds[pc], new Object(*value)));
+        }
+    }
+
+    return instructions;
+}
+
+bool write_objects(FILE *file, std::span<Object const> objects) {
+    for (auto const& object : objects) {
+        // Copied field by field, so the padding is written as zeroes
+        u8 buffer[sizeof(Object)] = {};
+        memcpy(buffer + offsetof(Object, kind), &object.kind, sizeof object.kind);
+        memcpy(buffer + offsetof(Object, data), &object.data, sizeof object.data);
+        if (fwrite(buffer, sizeof buffer, 1, file) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Storage of a decoded varint container
+struct DecodedArrays {
+    std::vector<InstructionKind> kinds;
+    std::vector<u32>             arguments;
+    std::vector<Object>          constants;
+};
+
+u64 zigzag_encode(u64 value) {
+    return (value << 1) ^ static_cast<u64>(static_cast<int64_t>(value) >> 63);
+}
+
+u64 zigzag_decode(u64 value) {
+    return (value >> 1) ^ (~(value & 1) + 1);
+}
+
+void append_varint(std::vector<u8>& out, u64 value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<u8>(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(static_cast<u8>(value));
+}
+
+// Reads a LEB128 varint at position and advances it. Returns false if the
+// varint is truncated or longer than 10 bytes.
+inline bool read_varint(std::span<u8 const> in, u64& position, u64& value) {
+    // Almost all constant indices and jump offsets fit into a single byte
+    if (position < in.size() && in[position] < 0x80) [[likely]] {
+        value = in[position++];
+        return true;
+    }
+
+    value = 0;
+    for (u32 shift = 0; shift < 64; shift += 7) {
+        if (position >= in.size()) {
+            return false;
+        }
+        u8 byte = in[position++];
+        value |= static_cast<u64>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Decodes the varint sections into arrays and points the view at them
+void decode_varint(ContainerView& view, DecodedArrays& arrays, Error **error) {
+    u64 position = 0;
+    u64 count = 0;
+    auto constants = view.varint_constants;
+
+    if (!read_varint(constants, position, count) || count == 0 || count > constants.size()) {
+        container_error(error, "invalid constant count");
+        return;
+    }
+    arrays.constants.reserve(count);
+    for (u64 i = 0; i < count; i++) {
+        u64 data = 0;
+        if (position >= constants.size()) {
+            container_error(error, std::format("constant {} is truncated", i));
+            return;
+        }
+        auto kind = static_cast<ObjectKind>(constants[position++]);
+        if (kind > ObjectKind::Last || !read_varint(constants, position, data)) {
+            container_error(error, std::format("constant {} is invalid", i));
+            return;
+        }
+        arrays.constants.push_back(Object(kind, data));
+    }
+    if (arrays.constants[0].kind != ObjectKind::Last) {
+        container_error(error, "the constant section has to start with the empty constant");
+        return;
+    }
+
+    // Jump targets are stored relative to their instruction and added to the
+    // constants when decoding. Every instruction takes at least one byte, so
+    // the constant of every target within the program has a slot, 0 until
+    // it is added.
+    auto code = view.varint_code;
+    std::vector<u32> targets(code.size() + 1, 0);
+    position = 0;
+
+    arrays.kinds.reserve(code.size() + 1);
+    arrays.arguments.reserve(code.size());
+    while (position < code.size()) {
+        u64 pc = arrays.arguments.size();
+        auto kind = static_cast<InstructionKind>(code[position++]);
+        if (kind >= InstructionKind::Last) {
+            container_error(error, std::format("instruction {} has the invalid kind {}", pc, static_cast<u8>(kind)));
+            return;
+        }
+
+        u64 argument = 0;
+        if (instruction_argument_amount(kind) > 0) {
+            if (!read_varint(code, position, argument)) {
+                container_error(error, std::format("the argument of instruction {} is truncated", pc));
+                return;
+            }
+
+            if (kind == InstructionKind::Jmp || kind == InstructionKind::JmpIf) {
+                u64 target = pc + zigzag_decode(argument);
+                // Targets outside of the program are rejected by verify,
+                // they get a constant each
+                if (target >= targets.size() || targets[target] == 0) {
+                    argument = arrays.constants.size();
+                    arrays.constants.push_back(Object(ObjectKind::U64, target));
+                    if (target < targets.size()) {
+                        targets[target] = static_cast<u32>(argument);
+                    }
+                } else {
+                    argument = targets[target];
+                }
+            } else if (argument >= count) {
+                container_error(error, std::format("instruction {} refers to constant {}, but there are only {}", pc, argument, count));
+                return;
+            }
+        }
+
+        arrays.kinds.push_back(kind);
+        arrays.arguments.push_back(static_cast<u32>(argument));
+    }
+    arrays.kinds.push_back(InstructionKind::Last);
+
+    view.kinds = arrays.kinds;
+    view.arguments = arrays.arguments;
+    view.constants = arrays.constants;
+    view.flags &= ~flag_varint;
+}
+
+// Encodes the code for write_code with Encoding::Varint
+bool encode_varint(Code const& code, std::vector<u8>& code_out, std::vector<u8>& constants_out, Error **error) {
+    // Only constants of Push are written, in the order they are first used.
+    // The decoder rebuilds the jump targets. 0 until a constant is used,
+    // the empty constant always comes first.
+    std::vector<u32> indices(code.constants.size(), 0);
+    std::vector<u32> used{0};
+    for (u64 pc = 0; pc < code.size(); pc++) {
+        InstructionKind kind = code.kinds[pc];
+        u32 argument = code.arguments[pc];
+        if (kind == InstructionKind::Jmp || kind == InstructionKind::JmpIf || argument == 0) {
+            continue;
+        }
+        if (indices[argument] == 0) {
+            indices[argument] = used.size();
+            used.push_back(argument);
+        }
+    }
+
+    append_varint(constants_out, used.size());
+    for (u32 index : used) {
+        constants_out.push_back(static_cast<u8>(code.constants[index].kind));
+        append_varint(constants_out, code.constants[index].data);
+    }
+
+    for (u64 pc = 0; pc < code.size(); pc++) {
+        InstructionKind kind = code.kinds[pc];
+        Object const *value = code.operand(pc);
+
+        if (kind >= InstructionKind::Last || (instruction_argument_amount(kind) > 0) != (value != nullptr)) {
+            container_error(error, std::format("instruction {} can not be encoded, it is invalid", pc));
+            return false;
+        }
+
+        code_out.push_back(static_cast<u8>(kind));
+        if (value == nullptr) {
+            continue;
+        }
+
+        if (kind == InstructionKind::Jmp || kind == InstructionKind::JmpIf) {
+            if (value->kind != ObjectKind::U64) {
+                container_error(error, std::format("instruction {} can not be encoded, its target is not a U64", pc));
+                return false;
+            }
+            append_varint(code_out, zigzag_encode(value->data - pc));
+        } else {
+            append_varint(code_out, indices[code.arguments[pc]]);
+        }
+    }
+
+    return true;
+}
+
+bool write_padding(FILE *file, u64 from, u64 to) {
+    static const u8 zeroes[section_alignment] = {};
+    return to == from || fwrite(zeroes, 1, to - from, file) == to - from;
+}
+
+}
+
+void write_code(FILE *file, Code const& code, Error **error) {
+    write_code(file, code, Encoding::Fixed, error);
+}
+
+void write_code(FILE *file, Code const& code, Encoding encoding, Error **error) {
+    FileHeader header{};
+    memcpy(header.magic, magic, sizeof magic);
+    header.version = version;
+
+    std::vector<u8> varint_code{};
+    std::vector<u8> varint_constants{};
+    std::vector<std::pair<SectionKind, std::span<std::byte const>>> contents{};
+
+    if (encoding == Encoding::Varint) {
+        if (!encode_varint(code, varint_code, varint_constants, error)) {
+            return;
+        }
+        header.flags |= flag_varint;
+        contents.push_back({SectionKind::VarintCode, std::as_bytes(std::span(varint_code))});
+        contents.push_back({SectionKind::VarintConstants, std::as_bytes(std::span(varint_constants))});
+    } else {
+        contents.push_back({SectionKind::Kinds, std::as_bytes(code.kinds)});
+        contents.push_back({SectionKind::Arguments, std::as_bytes(code.arguments)});
+        contents.push_back({SectionKind::Constants, {}});
+    }
+    header.section_count = contents.size();
+
+    std::vector<SectionHeader> sections{};
+    u64 offset = sizeof header + header.section_count * sizeof(SectionHeader);
+    for (auto [kind, bytes] : contents) {
+        u64 size = kind == SectionKind::Constants ? code.constants.size() * sizeof(Object) : bytes.size();
+        sections.push_back({kind, 0, align(offset), size});
+        offset = align(offset) + size;
+    }
+
+    if (fwrite(&header, sizeof header, 1, file) != 1) goto write_error;
+    if (fwrite(sections.data(), sizeof(SectionHeader), sections.size(), file) != sections.size()) goto write_error;
+
+    offset = sizeof header + header.section_count * sizeof(SectionHeader);
+    for (u64 i = 0; i < sections.size(); i++) {
+        if (!write_padding(file, offset, sections[i].offset)) goto write_error;
+
+        if (sections[i].kind == SectionKind::Constants) {
+            if (!write_objects(file, code.constants)) goto write_error;
+        } else {
+            auto bytes = contents[i].second;
+            if (fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) goto write_error;
+        }
+        offset = sections[i].offset + sections[i].size;
+    }
+
+    return;
+
+write_error:
+    *error = new Error(ErrorKind::FileError, error_concat("failed to write file: ", strerror(errno)));
+}
+
+void write_bytecode(FILE *file, std::vector<Instruction> const& bytecode, Error **error) {
+    write_code(file, Code(bytecode), error);
+}
+
+Code code_from_file(std::string_view filename, Error **error) {
+    std::string path{filename};
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *error = new Error(ErrorKind::FileNotFound, strerror(errno));
+        return Code();
+    }
+    defer(close(fd));
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        *error = new Error(ErrorKind::FileError, error_concat("failed to stat file: ", strerror(errno)));
+        return Code();
+    }
+
+    u64 size = static_cast<u64>(info.st_size);
+    void *address = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+    if (address == MAP_FAILED || !is_container(static_cast<u8 const*>(address), size)) {
+        if (address != MAP_FAILED) {
+            munmap(address, size);
+        }
+        // Raw bytecode, which has to be decoded. The instructions only live
+        // until the code is built, so their operands are freed at once.
+        ObjectArena arena{};
+        auto bytecode = bytecode_from_file(filename, arena, error);
+        if (*error != nullptr) {
+            return Code();
+        }
+        return Code(bytecode);
+    }
+
+    std::shared_ptr<void const> mapping{address, [size](void const *address) {
+        munmap(const_cast<void*>(address), size);
+    }};
+
+    ContainerView view = parse_container(static_cast<u8 const*>(address), size, error);
+    if (*error != nullptr) {
+        return Code();
+    }
+
+    if ((view.flags & flag_varint) != 0) {
+        // The decoded arrays replace the mapping, which is released here
+        auto arrays = std::make_shared<DecodedArrays>();
+        decode_varint(view, *arrays, error);
+        if (*error != nullptr) {
+            return Code();
+        }
+        return Code(view.kinds, view.arguments, view.constants, std::move(arrays));
+    }
+    return Code(view.kinds, view.arguments, view.constants, std::move(mapping));
+}
+
+std::vector<Instruction> bytecode_from_container(FILE *file, ObjectArena *arena, Error **error) {
+    std::vector<u8> data{};
+    u8 buffer[4096];
+    size_t read;
+
+    while ((read = fread(buffer, 1, sizeof buffer, file)) > 0) {
+        data.insert(data.end(), buffer, buffer + read);
+    }
+    if (ferror(file)) {
+        *error = new Error(ErrorKind::FileError, error_concat("failed to read file: ", strerror(errno)));
+        return {};
+    }
+
+    ContainerView view = parse_container(data.data(), data.size(), error);
+    if (*error != nullptr) {
+        return {};
+    }
+
+    DecodedArrays arrays{};
+    if ((view.flags & flag_varint) != 0) {
+        decode_varint(view, arrays, error);
+        if (*error != nullptr) {
+            return {};
+        }
+    }
+
+    auto instructions = container_instructions(view, arena, error);
+    if (*error != nullptr) {
+        return instructions;
+    }
+
+    *error = nullptr;
+    return instructions;
+}
+
+}
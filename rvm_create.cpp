@@ -7,6 +7,7 @@
 #include <ostream>
 #include <rvm.hpp>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -52,6 +53,9 @@ struct ConsoleUI {
 
     bool is_object_input_invalid = false;
 
+    // Owns the operands of the loaded file, declared before the
+    // instructions so it outlives them
+    rvm::ObjectArena arena{};
     std::vector<rvm::Instruction> instructions{};
 
 
@@ -103,8 +107,10 @@ struct ConsoleUI {
 
     std::string save_to_file{};
     std::string error_display{};
+    bool optimize_on_save = false;
     Component create_save_to_file() {
         Component input = Input(&save_to_file);
+        Component optimize = Checkbox("Optimize", &optimize_on_save);
         Component save_button = Button("Save", [this]{
             FILE *file = fopen(save_to_file.c_str(), "w+b");
             if (file == NULL) {
@@ -116,23 +122,27 @@ struct ConsoleUI {
             rvm::Error *error = nullptr;
             defer(if (error != nullptr) delete error;);
 
-            for (auto instruction : instructions) {
-                instruction.write(file, &error);
-
-                if (error != nullptr) {
-                    error_display = std::format("Error while writing instruction: {}", error->what());
-                    delete error;
-                    error = nullptr;
-                    return;
-                }
+            if (optimize_on_save) {
+                // The instruction list stays as entered, only the file is optimized
+                auto optimized = instructions;
+                rvm::optimize(optimized);
+                rvm::write_bytecode(file, optimized, &error);
+            } else {
+                rvm::write_bytecode(file, instructions, &error);
+            }
+            if (error != nullptr) {
+                error_display = std::format("Error while writing instructions: {}", error->what());
+                delete error;
+                error = nullptr;
+                return;
             }
 
         });
 
         return Renderer(
-            Container::Horizontal({ input, save_button }),
+            Container::Horizontal({ input, optimize, save_button }),
             [=, this] {
-                return hbox({input->Render() | size(WIDTH, GREATER_THAN, 30) | border, save_button->Render() | center, text(error_display) | color(Color::Red)});
+                return hbox({input->Render() | size(WIDTH, GREATER_THAN, 30) | border, optimize->Render() | center, save_button->Render() | center, text(error_display) | color(Color::Red)});
             }
         );
     }
@@ -179,18 +189,27 @@ int main(int argc, char **argv) {
 
     auto ui = ConsoleUI();
 
-    if (argc > 1) {
+    char *path = nullptr;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (std::string_view(args[i]) == "--optimize") {
+            ui.optimize_on_save = true;
+        } else if (path == nullptr) {
+            path = args[i];
+        }
+    }
+
+    if (path != nullptr) {
         rvm::Error *error = nullptr;
         defer(if (error != nullptr) { delete error; });
-        auto bytecode = rvm::bytecode_from_file(args[1], &error);
+        auto bytecode = rvm::bytecode_from_file(path, ui.arena, &error);
         if (error != nullptr) {
-            std::cerr << "Error while parsing bytecode in file " << args[1] << " error: " << error->what() << std::endl;
+            std::cerr << "Error while parsing bytecode in file " << path << " error: " << error->what() << std::endl;
             delete error;
             return 1;
         }
 
         ui.instructions = std::move(bytecode);
-        ui.save_to_file = args[1];
+        ui.save_to_file = path;
     }
 
     return ui.Run();
@@ -0,0 +1,89 @@
+// rvm program generator
+// Writes a random program of a given shape, see rvm::generate. The same
+// options always produce the same file, so a seed is enough to reproduce a
+// program of the regression corpus.
+
+#include "rvm.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+void usage() {
+    std::cerr << "usage: rvm-gen [--seed <n>] [--size <n>] [--branches <0-1>] [--dynamic <0-1>] [--depth <n>] [--constants <n>]\n";
+    std::cerr << "               [--format raw|fixed|varint] <output>\n";
+}
+
+int main(int argc, char **argv) {
+    std::vector<char*> args = std::vector<char*>(argv, argv + argc);
+
+    rvm::GenerateOptions options{};
+    std::string_view format = "raw";
+    char *path = nullptr;
+    for (size_t i = 1; i < args.size(); i++) {
+        std::string_view arg = args[i];
+        bool has_value = i + 1 < args.size();
+        if (arg == "--seed" && has_value) {
+            options.seed = strtoull(args[++i], nullptr, 0);
+        } else if (arg == "--size" && has_value) {
+            options.size = strtoull(args[++i], nullptr, 0);
+        } else if (arg == "--branches" && has_value) {
+            options.branch_density = strtod(args[++i], nullptr);
+        } else if (arg == "--dynamic" && has_value) {
+            options.dynamic_jumps = strtod(args[++i], nullptr);
+        } else if (arg == "--depth" && has_value) {
+            options.max_stack_depth = strtoull(args[++i], nullptr, 0);
+        } else if (arg == "--constants" && has_value) {
+            options.constants = strtoull(args[++i], nullptr, 0);
+        } else if (arg == "--format" && has_value) {
+            format = args[++i];
+        } else if (path == nullptr && !arg.starts_with("--")) {
+            path = args[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (path == nullptr || (format != "raw" && format != "fixed" && format != "varint")) {
+        usage();
+        return 1;
+    }
+
+    auto bytecode = rvm::generate(options);
+
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+        std::cerr << "ERROR: could not open " << path << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+
+    rvm::Error *error = nullptr;
+    if (format == "raw") {
+        for (auto& instruction : bytecode) {
+            instruction.write(file, &error);
+            if (error != nullptr) {
+                break;
+            }
+        }
+    } else if (format == "fixed") {
+        rvm::write_bytecode(file, bytecode, &error);
+    } else {
+        rvm::write_code(file, rvm::Code(bytecode), rvm::Encoding::Varint, &error);
+    }
+
+    bool closed = fclose(file) == 0;
+    if (error != nullptr) {
+        std::cerr << "ERROR: " << error->what() << std::endl;
+        delete error;
+        return 2;
+    }
+    if (!closed) {
+        std::cerr << "ERROR: failed to write " << path << ": " << strerror(errno) << std::endl;
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "rvm.hpp"
+#include <algorithm>
+#include <limits>
+#include <queue>
+#include <vector>
+
+namespace rvm {
+
+namespace {
+
+// splitmix64, small and good enough for shaping programs
+struct Random {
+    u64 state;
+
+    u64 next() {
+        u64 z = (state += 0x9E3779B97F4A7C15);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+        return z ^ (z >> 31);
+    }
+
+    // In [0, bound)
+    u64 below(u64 bound) {
+        return bound == 0 ? 0 : next() % bound;
+    }
+
+    bool chance(double probability) {
+        return static_cast<double>(next() >> 11) * 0x1.0p-53 < probability;
+    }
+};
+
+// The farthest a jump goes, so the targets stay spread over the program
+constexpr u64 max_jump_distance = 256;
+
+}
+
+std::vector<Instruction> generate(GenerateOptions const& options) {
+    constexpr u64 none = std::numeric_limits<u64>::max();
+    Random random{options.seed};
+    u64 size = options.size;
+    // One value always stays on the stack, nothing can pop it
+    u64 max_depth = std::max<u64>(options.max_stack_depth, 2);
+
+    std::vector<u64> pool(std::max<u64>(options.constants, 1));
+    for (auto& constant : pool) {
+        constant = random.below(1 << 16);
+    }
+
+    std::vector<Instruction> out{};
+    out.reserve(size);
+    auto push = [&](ObjectKind kind, u64 data) {
+        out.push_back(Instruction(InstructionKind::Push, new Object(kind, data)));
+    };
+
+    // Jump targets ahead, each has to be reached with a depth of 1. Adding
+    // up the stack before the next target always fits, because a value is
+    // only pushed if there is room to add it up again.
+    std::priority_queue<u64, std::vector<u64>, std::greater<u64>> targets{};
+    u64 depth = 0;
+
+    while (out.size() < size) {
+        u64 pc = out.size();
+        while (!targets.empty() && targets.top() <= pc) {
+            targets.pop();
+        }
+        u64 next = targets.empty() ? none : targets.top();
+        // Instructions left before the next target, the depth at pc is
+        // already 1 if pc is a target
+        u64 room = next == none ? none : next - pc;
+
+        if (depth == 0) {
+            push(ObjectKind::U64, pool[random.below(pool.size())]);
+            depth = 1;
+            continue;
+        }
+
+        // Just enough room left to add everything up before the target
+        if (depth > 1 && room == depth - 1) {
+            out.push_back(Instruction(random.chance(0.5) ? InstructionKind::Add : InstructionKind::Sub));
+            depth--;
+            continue;
+        }
+
+        // The values pushed by a jump would be on the stack at a target in
+        // between, so the whole sequence has to fit before the next target
+        bool dynamic = random.chance(options.dynamic_jumps);
+        bool conditional = random.chance(0.75);
+        u64 length = (dynamic ? 1 : 0) + (conditional ? 1 : 0) + 1;
+        if (depth == 1 && pc + length <= size && room >= length && random.chance(options.branch_density)) {
+            u64 after = pc + length;
+            u64 target = std::min(after + random.below(max_jump_distance), size);
+            if (target < size) {
+                targets.push(target);
+            }
+            if (conditional) {
+                push(ObjectKind::Bool, random.chance(0.5));
+            }
+            if (dynamic) {
+                push(ObjectKind::U64, target);
+                out.push_back(Instruction(conditional ? InstructionKind::JmpIfO : InstructionKind::JmpO));
+            } else {
+                out.push_back(Instruction(conditional ? InstructionKind::JmpIf : InstructionKind::Jmp, new Object(ObjectKind::U64, target)));
+            }
+            continue;
+        }
+
+        // A push needs room to add it up again
+        bool can_push = depth < max_depth && (room == none || room > depth);
+        if (can_push && (depth == 1 || random.chance(0.5))) {
+            push(ObjectKind::U64, pool[random.below(pool.size())]);
+            depth++;
+        } else if (depth > 1) {
+            out.push_back(Instruction(random.chance(0.5) ? InstructionKind::Add : InstructionKind::Sub));
+            depth--;
+        } else {
+            out.push_back(Instruction(InstructionKind::Nop));
+        }
+    }
+
+    return out;
+}
+
+}
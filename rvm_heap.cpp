@@ -0,0 +1,241 @@
+#include "rvm.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace rvm {
+
+namespace {
+
+// Set in the header of an object which was copied while collecting, the
+// other bits are the index of the copy
+constexpr u64 forwarded = u64(1) << 63;
+
+// Returns nullptr if the values could not be allocated
+std::shared_ptr<std::vector<Object>> make_space(u64 capacity) {
+    try {
+        return std::make_shared<std::vector<Object>>(capacity);
+    } catch (std::bad_alloc const&) {
+        return nullptr;
+    }
+}
+
+}
+
+Heap::Heap(Heap const& rhs)
+    : limit(rhs.limit), space(rhs.space), top(rhs.top), collected(rhs.collected) {
+}
+
+Heap& Heap::operator=(Heap const& rhs) {
+    if (this != &rhs) {
+        limit = rhs.limit;
+        space = rhs.space;
+        spare = std::vector<Object>();
+        top = rhs.top;
+        collected = rhs.collected;
+    }
+    return *this;
+}
+
+Object Heap::allocate(u64 size, std::span<Object> roots) {
+    u64 words = size + 1;
+    if (words > capacity() - top && !reserve(words, roots)) [[unlikely]] {
+        return Object();
+    }
+    // Values past top of a shared half belong to every copy
+    if (!unshare()) [[unlikely]] {
+        return Object();
+    }
+
+    Object pointer(ObjectKind::Pointer, top);
+    Object *object = space->data() + top;
+    object[0] = Object(ObjectKind::Last, size);
+    std::fill_n(object + 1, size, Object(ObjectKind::U64, static_cast<u64>(0)));
+    top += words;
+    return pointer;
+}
+
+bool Heap::contains(Object pointer) const {
+    // Values never have the kind Last, so only headers match
+    return pointer.kind == ObjectKind::Pointer && pointer.data < top && (*space)[pointer.data].kind == ObjectKind::Last;
+}
+
+bool Heap::collect(std::span<Object> roots) {
+    if (space == nullptr) {
+        collected++;
+        return true;
+    }
+    // A shared half is only read, copying it first would copy the garbage
+    // as well
+    bool shared = space.use_count() > 1;
+    if (!shared) {
+        // Pairs with the release of the last other copy, see unshare
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    if (spare.size() != space->size()) {
+        try {
+            spare = std::vector<Object>(space->size());
+        } catch (std::bad_alloc const&) {
+            return false;
+        }
+    }
+
+    Object *from = space->data();
+    Object *to = spare.data();
+    u64 free = 0;
+    // Copies of the objects of a shared half, an owned half stores them in
+    // the headers instead. Filling the map can fail, so the roots are saved
+    // to leave them unchanged.
+    std::unordered_map<u64, u64> copies{};
+    std::vector<Object> saved{};
+    if (shared) {
+        try {
+            saved.assign(roots.begin(), roots.end());
+        } catch (std::bad_alloc const&) {
+            return false;
+        }
+    }
+
+    // Copies the object pointer points at, unless it was already copied,
+    // and points pointer at the copy
+    auto evacuate = [&](Object& pointer) {
+        if (!contains(pointer)) {
+            return;
+        }
+        Object& header = from[pointer.data];
+        if (shared) {
+            auto copy = copies.find(pointer.data);
+            if (copy != copies.end()) {
+                pointer.data = copy->second;
+                return;
+            }
+        } else if ((header.data & forwarded) != 0) {
+            pointer.data = header.data & ~forwarded;
+            return;
+        }
+
+        u64 words = header.data + 1;
+        std::copy_n(&header, words, to + free);
+        if (shared) {
+            copies.emplace(pointer.data, free);
+        } else {
+            header.data = forwarded | free;
+        }
+        pointer.data = free;
+        free += words;
+    };
+
+    try {
+        for (auto& root : roots) {
+            evacuate(root);
+        }
+        // Everything between scan and free was copied, but still points
+        // into the old half
+        for (u64 scan = 0; scan < free; scan += to[scan].data + 1) {
+            for (u64 i = 1; i <= to[scan].data; i++) {
+                evacuate(to[scan + i]);
+            }
+        }
+
+        if (shared) {
+            // The copies keep the old half, the new one is owned
+            space = std::make_shared<std::vector<Object>>(std::move(spare));
+            spare = std::vector<Object>();
+        } else {
+            space->swap(spare);
+        }
+    } catch (std::bad_alloc const&) {
+        // Only a shared half, which is left unchanged, allocates
+        std::copy(saved.begin(), saved.end(), roots.begin());
+        return false;
+    }
+    top = free;
+    collected++;
+    return true;
+}
+
+u64 Heap::max_capacity() const {
+    return limit / (2 * sizeof(Object));
+}
+
+bool Heap::unshare() {
+    if (space == nullptr) {
+        return true;
+    }
+    if (space.use_count() == 1) {
+        // Pairs with the release of the last other copy, its writes have
+        // to be visible before this one changes the values
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    auto copy = make_space(space->size());
+    if (copy == nullptr) {
+        return false;
+    }
+    std::copy_n(space->begin(), top, copy->begin());
+    space = std::move(copy);
+    return true;
+}
+
+// Returns false if there is no room for words values after collecting
+bool Heap::reserve(u64 words, std::span<Object> roots) {
+    if (top > 0 && !collect(roots)) {
+        return false;
+    }
+    // Growing while the heap is still half empty would make every
+    // collection copy about as much as is allocated until the next one
+    u64 needed = top + words;
+    if (needed <= capacity() / 2) {
+        return true;
+    }
+    if (needed <= max_capacity()) {
+        grow(std::min(std::max({capacity() * 2, needed * 2, initial_capacity}), max_capacity()));
+    }
+    return needed <= capacity();
+}
+
+// The size of an object is chosen by the program, so running out of memory
+// is reported to it instead of terminating the host. Returns false and
+// keeps the heap if the new half could not be allocated.
+bool Heap::grow(u64 capacity) {
+    auto grown = make_space(capacity);
+    if (grown == nullptr) {
+        return false;
+    }
+    // Only the used values are copied, the other half is allocated by the
+    // next collection
+    if (top > 0) {
+        std::copy_n(space->begin(), top, grown->begin());
+    }
+    space = std::move(grown);
+    spare = std::vector<Object>();
+    return true;
+}
+
+bool Heap::assign(void const *values, u64 count) {
+    if (count > max_capacity()) {
+        return false;
+    }
+    if (capacity() < count || space.use_count() > 1) {
+        auto fresh = make_space(std::min(std::max({count * 2, capacity(), initial_capacity}), max_capacity()));
+        if (fresh == nullptr) {
+            return false;
+        }
+        space = std::move(fresh);
+        spare = std::vector<Object>();
+    }
+    if (count > 0) {
+        memcpy(space->data(), values, count * sizeof(Object));
+    }
+    top = count;
+    return true;
+}
+
+}
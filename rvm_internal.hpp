@@ -0,0 +1,53 @@
+#pragma once
+
+// Declarations shared between the translation units of the rvm library,
+// which are not part of the installed rvm.hpp
+
+#include "rvm.hpp"
+#include <cstdio>
+#include <tuple>
+#include <vector>
+
+// Labels as values are a GNU extension, every other compiler uses a switch.
+// The dispatch loops of the stack and the register engine are wrapped in
+// RVM_DISPATCH_BEGIN and RVM_DISPATCH_END, which silence the pedantic
+// warning about them.
+#ifndef RVM_THREADED_DISPATCH
+#if defined(__GNUC__) || defined(__clang__)
+#define RVM_THREADED_DISPATCH 1
+#else
+#define RVM_THREADED_DISPATCH 0
+#endif
+#endif
+
+#if RVM_THREADED_DISPATCH
+#define RVM_DISPATCH_BEGIN                              \
+    _Pragma("GCC diagnostic push")                      \
+    _Pragma("GCC diagnostic ignored \"-Wpedantic\"")
+#define RVM_DISPATCH_END _Pragma("GCC diagnostic pop")
+#else
+#define RVM_DISPATCH_BEGIN
+#define RVM_DISPATCH_END
+#endif
+
+namespace rvm {
+
+// Returns prefix followed by error_str in a malloc'ed string and true, or
+// error_str itself and false if the allocation failed. Meant for the
+// constructor of Error.
+std::tuple<char const*, bool> error_concat(char const* prefix, char const* error_str);
+
+// Used by bytecode_from_file, after the magic number was found
+std::vector<Instruction> bytecode_from_container(FILE *file, ObjectArena *arena, Error **error);
+
+// Operators are only supported for two objects of the same integer kind
+inline bool operator_applicable(Object const& lhs, Object const& rhs) {
+    return lhs.kind == rhs.kind && lhs.kind != ObjectKind::Bool;
+}
+
+// Heap instructions are executed by step from the native and register code
+inline bool uses_heap(InstructionKind kind) {
+    return kind == InstructionKind::Alloc || kind == InstructionKind::Load || kind == InstructionKind::Store;
+}
+
+}
@@ -0,0 +1,567 @@
+#include "rvm.hpp"
+#include "rvm_internal.hpp"
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define RVM_JIT_SUPPORTED 1
+#else
+#define RVM_JIT_SUPPORTED 0
+#endif
+
+namespace rvm {
+
+namespace internal {
+
+// Executable memory with the compiled program. entries points to a table at
+// the end of the mapping with the address of the entry stub of every
+// instruction, 0 if the native code can not be entered there.
+struct JitCode {
+    void      *memory = nullptr;
+    size_t     size = 0;
+    u64 const *entries = nullptr;
+
+    JitCode() = default;
+    JitCode(JitCode const&) = delete;
+    JitCode& operator=(JitCode const&) = delete;
+    ~JitCode();
+};
+
+}
+
+#if RVM_JIT_SUPPORTED
+
+namespace {
+
+static_assert(offsetof(Object, kind) == 0 && offsetof(Object, data) == 8 && sizeof(Object) == 16, "The templates address objects directly");
+
+using JitFunction = internal::JitResult (*)(Object *stack);
+
+// Registers caching the data of the top of the stack: rcx, rdx, rsi, r8, r9,
+// r10 and r11. Slot i is kept in cached[i % window] while it is one of the
+// top window slots. All of them are caller saved, so the native code does
+// not save anything. rax is the scratch register.
+constexpr std::array<u8, 7> cached{1, 2, 6, 8, 9, 10, 11};
+constexpr u64 window = cached.size();
+constexpr u8 rax = 0;
+
+// First slot kept in a register at depth
+u64 window_begin(u64 depth) {
+    return depth > window ? depth - window : 0;
+}
+
+u8 cached_register(u64 index) {
+    return cached[index % window];
+}
+
+// Emits x86-64 machine code. The stack is addressed relative to rdi, which
+// holds the first argument of the compiled function, and slot i is at
+// rdi + 16 * i. Every instruction knows its stack depth, so no stack pointer
+// is kept at runtime.
+struct Assembler {
+    std::vector<u8> bytes{};
+
+    void emit(std::initializer_list<u8> values) {
+        bytes.insert(bytes.end(), values);
+    }
+
+    void emit32(u32 value) {
+        for (int i = 0; i < 4; i++) {
+            bytes.push_back(static_cast<u8>(value >> (i * 8)));
+        }
+    }
+
+    void emit64(u64 value) {
+        for (int i = 0; i < 8; i++) {
+            bytes.push_back(static_cast<u8>(value >> (i * 8)));
+        }
+    }
+
+    // Emits a rel32 to be patched and returns its position
+    size_t emit_rel32() {
+        size_t position = bytes.size();
+        emit32(0);
+        return position;
+    }
+
+    void patch_rel32(size_t position, size_t target) {
+        u32 relative = static_cast<u32>(static_cast<int64_t>(target) - static_cast<int64_t>(position + 4));
+        memcpy(&bytes[position], &relative, sizeof relative);
+    }
+
+    static u32 slot(u64 index) {
+        return static_cast<u32>(index * sizeof(Object));
+    }
+
+    // REX.W, with reg and rm extended for r8 to r15
+    void rex(u8 reg, u8 rm) {
+        emit({static_cast<u8>(0x48 | ((reg >> 3) << 2) | (rm >> 3))});
+    }
+
+    // ModRM for [rdi + disp32]
+    static u8 modrm_stack(u8 reg) {
+        return static_cast<u8>(0x87 | ((reg & 7) << 3));
+    }
+
+    // ModRM for two registers
+    static u8 modrm_registers(u8 reg, u8 rm) {
+        return static_cast<u8>(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    // mov reg, [rdi + slot + 8]
+    void load(u8 reg, u64 index) {
+        rex(reg, 0); emit({0x8B, modrm_stack(reg)}); emit32(slot(index) + 8);
+    }
+
+    // mov [rdi + slot + 8], reg
+    void spill(u64 index, u8 reg) {
+        rex(reg, 0); emit({0x89, modrm_stack(reg)}); emit32(slot(index) + 8);
+    }
+
+    // mov byte [rdi + slot], kind
+    void store_kind(u64 index, ObjectKind kind) {
+        emit({0xC6, 0x87}); emit32(slot(index)); emit({static_cast<u8>(kind)});
+    }
+
+    // mov reg, value
+    void move(u8 reg, u64 value) {
+        if (value <= std::numeric_limits<u32>::max()) {
+            // The 32 bit form clears the upper half
+            if (reg >= 8) {
+                emit({0x41});
+            }
+            emit({static_cast<u8>(0xB8 | (reg & 7))}); emit32(static_cast<u32>(value));
+        } else {
+            rex(0, reg); emit({static_cast<u8>(0xB8 | (reg & 7))}); emit64(value);
+        }
+    }
+
+    // Writes value to the stack, through rax
+    void store(u64 index, Object const& value) {
+        store_kind(index, value.kind);
+        move(rax, value.data);
+        spill(index, rax);
+    }
+
+    // add/sub reg, rhs
+    void arithmetic(InstructionKind kind, u8 reg, u8 rhs) {
+        rex(rhs, reg); emit({static_cast<u8>(kind == InstructionKind::Add ? 0x01 : 0x29), modrm_registers(rhs, reg)});
+    }
+
+    // add/sub reg, value
+    void arithmetic_constant(InstructionKind kind, u8 reg, u64 value) {
+        auto immediate = static_cast<int64_t>(value);
+        if (immediate < std::numeric_limits<int32_t>::min() || immediate > std::numeric_limits<int32_t>::max()) {
+            move(rax, value);
+            arithmetic(kind, reg, rax);
+            return;
+        }
+        rex(0, reg); emit({0x81, modrm_registers(kind == InstructionKind::Add ? 0 : 5, reg)}); emit32(static_cast<u32>(value));
+    }
+
+    // cmp byte [rdi + slot], kind
+    void compare_kind(u64 index, ObjectKind kind) {
+        emit({0x80, 0xBF}); emit32(slot(index)); emit({static_cast<u8>(kind)});
+    }
+
+    // test reg, reg
+    void test(u8 reg) {
+        rex(reg, reg); emit({0x85, modrm_registers(reg, reg)});
+    }
+};
+
+// What the compiler knows about a slot in the window
+struct Slot {
+    // Set if the slot holds constant, which is neither in the register nor
+    // on the stack yet
+    bool       pending = false;
+    Object     constant{};
+    // ObjectKind::Last if only known at runtime
+    ObjectKind kind = ObjectKind::Last;
+};
+
+// Leaves the compiled code at pc with depth values on the stack. The
+// interpreter continues from there. The exit stub loads the pending
+// constants exit_constants[begin, end) and jumps to the tail for depth,
+// which writes the window back to the stack.
+struct Exit {
+    size_t jump;
+    u64    pc;
+    u64    depth;
+    size_t begin;
+    size_t end;
+};
+
+}
+
+static std::shared_ptr<internal::JitCode const> compile_code(Code const& code) {
+    constexpr size_t none = std::numeric_limits<size_t>::max();
+    u64 size = code.size();
+
+    // pcs and stack offsets are encoded as 32 bit immediates
+    if (!code.stack_depth_known || size >= (static_cast<u64>(1) << 31) || code.max_stack_depth >= (static_cast<u64>(1) << 26)) {
+        return nullptr;
+    }
+
+    CFG cfg{code};
+    Assembler a{};
+    // Code of the instructions the native code can be entered at, the
+    // start of every block and the instruction after a heap instruction.
+    // The whole window is in the registers there.
+    std::vector<size_t> entries(size, none);
+    // Positions of the jumps to entries, patched once all of them are known
+    std::vector<std::pair<size_t, u64>> jumps{};
+    std::vector<Exit> exits{};
+    std::vector<std::pair<u64, Object>> exit_constants{};
+
+    std::array<Slot, window> slots{};
+    auto state = [&](u64 index) -> Slot& {
+        return slots[index % window];
+    };
+
+    // Loads a pending constant into its register
+    auto materialize = [&](u64 index) {
+        Slot& slot = state(index);
+        if (slot.pending) {
+            a.store_kind(index, slot.constant.kind);
+            a.move(cached_register(index), slot.constant.data);
+            slot.pending = false;
+        }
+    };
+
+    // Loads all pending constants, every way into an entry does that
+    auto flush = [&](u64 depth) {
+        for (u64 i = window_begin(depth); i < depth; i++) {
+            materialize(i);
+        }
+    };
+
+    auto leave = [&](size_t jump, u64 pc, u64 depth) {
+        size_t begin = exit_constants.size();
+        for (u64 i = window_begin(depth); i < depth; i++) {
+            if (state(i).pending) {
+                exit_constants.push_back({i, state(i).constant});
+            }
+        }
+        exits.push_back({jump, pc, depth, begin, exit_constants.size()});
+    };
+
+    // Makes room for the slot at depth. The slot leaving the window is
+    // written to the stack.
+    auto push = [&](u64 depth) {
+        if (depth >= window) {
+            u64 index = depth - window;
+            if (state(index).pending) {
+                a.store(index, state(index).constant);
+            } else {
+                a.spill(index, cached_register(index));
+            }
+        }
+        state(depth) = Slot{};
+    };
+
+    // Drops the slot at depth - 1. The slot entering the window is loaded
+    // from the stack, which keeps the flags.
+    auto pop = [&](u64 depth) {
+        state(depth - 1) = Slot{};
+        if (depth - 1 >= window) {
+            a.load(cached_register(depth - 1), depth - 1 - window);
+        }
+    };
+
+    auto jump_to = [&](std::initializer_list<u8> opcode, u64 target, u64 depth) {
+        if (target >= size) {
+            a.emit(opcode);
+            leave(a.emit_rel32(), target, depth);
+            return;
+        }
+        flush(depth);
+        a.emit(opcode);
+        jumps.push_back({a.emit_rel32(), target});
+    };
+
+    // Set while the code before can fall through to the current instruction
+    bool reachable = false;
+
+    // The instruction fails or has no template
+    auto deopt = [&](u64 pc, u64 depth) {
+        a.emit({0xE9});
+        leave(a.emit_rel32(), pc, depth);
+        reachable = false;
+    };
+
+    for (auto const& block : cfg.blocks) {
+        if (!block.reachable) {
+            reachable = false;
+            continue;
+        }
+
+        if (reachable) {
+            flush(code.stack_depths[block.begin]);
+        }
+        entries[block.begin] = a.bytes.size();
+        slots.fill(Slot{});
+        reachable = true;
+
+        for (u64 pc = block.begin; pc < block.end; pc++) {
+            u64 depth = code.stack_depths[pc];
+            InstructionKind kind = code.kinds[pc];
+            if (!reachable && !uses_heap(kind)) {
+                continue;
+            }
+
+            switch (kind) {
+                case InstructionKind::Nop:
+                    break;
+                case InstructionKind::Push: {
+                    Object const& value = *code.operand(pc);
+                    push(depth);
+                    state(depth) = Slot{true, value, value.kind};
+                    break;
+                }
+                case InstructionKind::Add:
+                case InstructionKind::Sub: {
+                    Slot lhs = state(depth - 2);
+                    Slot rhs = state(depth - 1);
+                    if (lhs.kind != ObjectKind::Last && rhs.kind != ObjectKind::Last) {
+                        if (!operator_applicable(Object(lhs.kind, u64{}), Object(rhs.kind, u64{}))) {
+                            deopt(pc, depth);
+                            break;
+                        }
+                    } else if (lhs.kind != ObjectKind::Last || rhs.kind != ObjectKind::Last) {
+                        // Only the other kind is checked
+                        bool lhs_known = lhs.kind != ObjectKind::Last;
+                        ObjectKind known = lhs_known ? lhs.kind : rhs.kind;
+                        if (known == ObjectKind::Bool) {
+                            deopt(pc, depth);
+                            break;
+                        }
+                        // cmp byte [rdi + other], known
+                        // jne deopt
+                        a.compare_kind(lhs_known ? depth - 1 : depth - 2, known);
+                        a.emit({0x0F, 0x85}); leave(a.emit_rel32(), pc, depth);
+                    } else {
+                        u32 lhs_slot = Assembler::slot(depth - 2);
+                        u32 rhs_slot = Assembler::slot(depth - 1);
+                        // mov al, [rdi + lhs]
+                        // cmp al, [rdi + rhs]
+                        // jne deopt
+                        // cmp al, Bool
+                        // je deopt
+                        a.emit({0x8A, 0x87}); a.emit32(lhs_slot);
+                        a.emit({0x3A, 0x87}); a.emit32(rhs_slot);
+                        a.emit({0x0F, 0x85}); leave(a.emit_rel32(), pc, depth);
+                        a.emit({0x3C, static_cast<u8>(ObjectKind::Bool)});
+                        a.emit({0x0F, 0x84}); leave(a.emit_rel32(), pc, depth);
+                    }
+
+                    ObjectKind result = lhs.kind != ObjectKind::Last ? lhs.kind : rhs.kind;
+                    Slot& out = state(depth - 2);
+                    if (lhs.pending && rhs.pending) {
+                        u64 data = kind == InstructionKind::Sub ? lhs.constant.data - rhs.constant.data : lhs.constant.data + rhs.constant.data;
+                        out.constant = Object(result, data);
+                    } else {
+                        materialize(depth - 2);
+                        if (rhs.pending) {
+                            a.arithmetic_constant(kind, cached_register(depth - 2), rhs.constant.data);
+                        } else {
+                            a.arithmetic(kind, cached_register(depth - 2), cached_register(depth - 1));
+                        }
+                        out.kind = result;
+                    }
+                    pop(depth);
+                    break;
+                }
+                case InstructionKind::Jmp: {
+                    u64 target = code.operand(pc)->data;
+                    if (target != pc + 1) {
+                        jump_to({0xE9}, target, depth);
+                        reachable = false;
+                    }
+                    break;
+                }
+                case InstructionKind::JmpIf: {
+                    u64 target = code.operand(pc)->data;
+                    Slot cond = state(depth - 1);
+                    if (cond.kind != ObjectKind::Last && cond.kind != ObjectKind::Bool) {
+                        deopt(pc, depth);
+                        break;
+                    }
+                    if (cond.pending) {
+                        pop(depth);
+                        if (cond.constant.boolean() && target != pc + 1) {
+                            jump_to({0xE9}, target, depth - 1);
+                            reachable = false;
+                        }
+                        break;
+                    }
+                    if (cond.kind != ObjectKind::Bool) {
+                        // cmp byte [rdi + cond], Bool
+                        // jne deopt
+                        a.compare_kind(depth - 1, ObjectKind::Bool);
+                        a.emit({0x0F, 0x85}); leave(a.emit_rel32(), pc, depth);
+                    }
+                    if (target == pc + 1) {
+                        pop(depth);
+                        break;
+                    }
+                    // test cond, cond
+                    // jnz target
+                    a.test(cached_register(depth - 1));
+                    pop(depth);
+                    jump_to({0x0F, 0x85}, target, depth - 1);
+                    break;
+                }
+                default:
+                    // No template, the interpreter executes it. VM::run enters
+                    // the native code again after heap instructions.
+                    if (reachable) {
+                        deopt(pc, depth);
+                    }
+                    if (pc + 1 < block.end) {
+                        entries[pc + 1] = a.bytes.size();
+                        slots.fill(Slot{});
+                        reachable = true;
+                    }
+                    break;
+            }
+        }
+    }
+
+    // Falling off the end of the program
+    if (reachable) {
+        InstructionKind last = code.kinds[size - 1];
+        deopt(size, code.stack_depths[size - 1] - instruction_pops(last) + instruction_pushes(last));
+    }
+
+    for (auto [position, target] : jumps) {
+        a.patch_rel32(position, entries[target]);
+    }
+
+    // The exit stubs load the pending constants, so the tails only store
+    // registers:
+    //   mov [rdi + slot + 8], cached
+    //   mov edx, depth
+    //   ret
+    std::vector<size_t> tails(code.max_stack_depth + 1, none);
+    std::vector<std::pair<size_t, u64>> tail_jumps{};
+    for (auto const& exit : exits) {
+        a.patch_rel32(exit.jump, a.bytes.size());
+        for (size_t i = exit.begin; i < exit.end; i++) {
+            auto const& [index, constant] = exit_constants[i];
+            a.store_kind(index, constant.kind);
+            a.move(cached_register(index), constant.data);
+        }
+        // mov eax, pc
+        // jmp tail
+        a.emit({0xB8}); a.emit32(static_cast<u32>(exit.pc));
+        a.emit({0xE9}); tail_jumps.push_back({a.emit_rel32(), exit.depth});
+    }
+    for (auto [position, depth] : tail_jumps) {
+        if (tails[depth] == none) {
+            tails[depth] = a.bytes.size();
+            for (u64 i = window_begin(depth); i < depth; i++) {
+                a.spill(i, cached_register(i));
+            }
+            a.emit({0xBA}); a.emit32(static_cast<u32>(depth));
+            a.emit({0xC3});
+        }
+        a.patch_rel32(position, tails[depth]);
+    }
+
+    // Every entry stub loads the address of the code and jumps to the
+    // loader for its depth, which loads the window:
+    //   lea rax, [rip + code]
+    //   jmp loader
+    // loader:
+    //   mov cached, [rdi + slot + 8]
+    //   jmp rax
+    std::vector<size_t> stubs(size, none);
+    std::vector<size_t> loaders(code.max_stack_depth + 1, none);
+    std::vector<std::pair<size_t, u64>> loader_jumps{};
+    for (u64 pc = 0; pc < size; pc++) {
+        if (entries[pc] == none) {
+            continue;
+        }
+        stubs[pc] = a.bytes.size();
+        a.emit({0x48, 0x8D, 0x05}); a.patch_rel32(a.emit_rel32(), entries[pc]);
+        a.emit({0xE9}); loader_jumps.push_back({a.emit_rel32(), code.stack_depths[pc]});
+    }
+    for (auto [position, depth] : loader_jumps) {
+        if (loaders[depth] == none) {
+            loaders[depth] = a.bytes.size();
+            for (u64 i = window_begin(depth); i < depth; i++) {
+                a.load(cached_register(i), i);
+            }
+            a.emit({0xFF, 0xE0});
+        }
+        a.patch_rel32(position, loaders[depth]);
+    }
+
+    while (a.bytes.size() % sizeof(u64) != 0) {
+        a.emit({0xCC});
+    }
+    size_t table = a.bytes.size();
+    size_t total = table + size * sizeof(u64);
+
+    void *memory = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto jit = std::make_shared<internal::JitCode>();
+    jit->memory = memory;
+    jit->size = total;
+
+    u8 *base = static_cast<u8*>(memory);
+    memcpy(base, a.bytes.data(), a.bytes.size());
+    for (u64 pc = 0; pc < size; pc++) {
+        u64 address = stubs[pc] == none ? 0 : reinterpret_cast<u64>(base + stubs[pc]);
+        memcpy(base + table + pc * sizeof(u64), &address, sizeof address);
+    }
+    jit->entries = reinterpret_cast<u64 const*>(base + table);
+
+    if (mprotect(memory, total, PROT_READ | PROT_EXEC) != 0) {
+        return nullptr;
+    }
+    return jit;
+}
+
+internal::JitCode::~JitCode() {
+    if (memory != nullptr) {
+        munmap(memory, size);
+    }
+}
+
+internal::JitResult internal::jit_run(JitCode const& jit, Object *stack, u64 pc, u64 depth) {
+    if (jit.entries[pc] == 0) {
+        return {pc, depth};
+    }
+    auto function = reinterpret_cast<JitFunction>(jit.entries[pc]);
+    return function(stack);
+}
+
+#else
+
+static std::shared_ptr<internal::JitCode const> compile_code(Code const&) {
+    return nullptr;
+}
+
+internal::JitCode::~JitCode() {}
+
+internal::JitResult internal::jit_run(JitCode const&, Object*, u64 pc, u64 depth) {
+    return {pc, depth};
+}
+
+#endif
+
+void Code::compile() {
+    jit = compile_code(*this);
+}
+
+}
@@ -0,0 +1,263 @@
+#include "rvm.hpp"
+#include <utility>
+#include <vector>
+
+namespace rvm {
+
+namespace {
+
+bool has_dynamic_jumps(std::vector<Instruction> const& bytecode) {
+    for (auto const& instruction : bytecode) {
+        if (instruction.kind == InstructionKind::JmpO || instruction.kind == InstructionKind::JmpIfO) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_push(std::vector<Instruction> const& bytecode, u64 pc, ObjectKind kind) {
+    return pc < bytecode.size() && bytecode[pc].kind == InstructionKind::Push && bytecode[pc].value->kind == kind;
+}
+
+// Marks the first instruction of every block. A block can be entered from
+// somewhere else, so it can not be folded into the instruction before it.
+//
+// JmpO and JmpIfO right after the Push of their address always jump there,
+// unless something else jumps to them. If every dynamic jump is like that,
+// the pushed addresses are marked as well, otherwise every instruction could
+// be a target and is marked.
+std::vector<bool> jump_targets(std::vector<Instruction> const& bytecode, CFG const& cfg) {
+    u64 size = bytecode.size();
+    std::vector<bool> targets(size + 1, false);
+    for (auto const& block : cfg.blocks) {
+        targets[block.begin] = true;
+    }
+    if (!cfg.dynamic_jumps) {
+        return targets;
+    }
+
+    std::vector<u64> jumps{};
+    for (u64 pc = 0; pc < size; pc++) {
+        auto kind = bytecode[pc].kind;
+        if (kind != InstructionKind::JmpO && kind != InstructionKind::JmpIfO) {
+            continue;
+        }
+        if (pc == 0 || !is_push(bytecode, pc - 1, ObjectKind::U64) || targets[pc]) {
+            return std::vector<bool>(size + 1, true);
+        }
+        jumps.push_back(pc);
+    }
+    for (u64 pc : jumps) {
+        u64 address = bytecode[pc - 1].value->data;
+        if (address < size) {
+            targets[address] = true;
+        }
+    }
+    for (u64 pc : jumps) {
+        if (targets[pc]) {
+            return std::vector<bool>(size + 1, true);
+        }
+    }
+    return targets;
+}
+
+// Follows Nops and unconditional jumps starting at target. A chain longer
+// than the program is a loop, which is left alone.
+u64 final_target(std::vector<Instruction> const& bytecode, u64 start) {
+    u64 target = start;
+    for (u64 steps = 0; target < bytecode.size(); steps++) {
+        auto const& instruction = bytecode[target];
+        if (steps > bytecode.size()) {
+            return start;
+        } else if (instruction.kind == InstructionKind::Nop) {
+            target++;
+        } else if (instruction.kind == InstructionKind::Jmp) {
+            target = instruction.value->data;
+        } else {
+            break;
+        }
+    }
+    return target;
+}
+
+// Returns true if the chain final_target follows from start passes through pc
+bool chain_passes(std::vector<Instruction> const& bytecode, u64 start, u64 pc) {
+    u64 target = start;
+    for (u64 steps = 0; target < bytecode.size() && steps <= bytecode.size(); steps++) {
+        auto const& instruction = bytecode[target];
+        if (target == pc) {
+            return true;
+        } else if (instruction.kind == InstructionKind::Nop) {
+            target++;
+        } else if (instruction.kind == InstructionKind::Jmp) {
+            target = instruction.value->data;
+        } else {
+            break;
+        }
+    }
+    return false;
+}
+
+// Rewrites patterns in place without changing the position of any
+// instruction, removed instructions are replaced by Nops. New jump targets
+// are marked right away, so later patterns do not fold them. Returns true if
+// anything was changed.
+bool fold(std::vector<Instruction>& bytecode) {
+    bool changed = false;
+    CFG cfg{bytecode};
+    auto targets = jump_targets(bytecode, cfg);
+    u64 size = bytecode.size();
+
+    // Without dynamic jumps, blocks which are not reachable are never
+    // executed. No pattern below makes them reachable again.
+    for (auto const& block : cfg.blocks) {
+        if (block.reachable || cfg.dynamic_jumps) {
+            continue;
+        }
+        for (u64 pc = block.begin; pc < block.end; pc++) {
+            if (bytecode[pc].kind != InstructionKind::Nop) {
+                bytecode[pc] = Instruction(InstructionKind::Nop);
+                changed = true;
+            }
+        }
+    }
+
+    for (u64 pc = 0; pc < size; pc++) {
+        auto kind = bytecode[pc].kind;
+
+        // Push a; Push b; Add -> Push a + b
+        if (kind == InstructionKind::Push && pc + 2 < size && !targets[pc + 1] && !targets[pc + 2]
+            && bytecode[pc + 1].kind == InstructionKind::Push
+            && (bytecode[pc + 2].kind == InstructionKind::Add || bytecode[pc + 2].kind == InstructionKind::Sub)) {
+            Error *error = nullptr;
+            Operator op = bytecode[pc + 2].kind == InstructionKind::Sub ? Operator::Sub : Operator::Add;
+            Object result = bytecode[pc].value->apply_operator(op, *bytecode[pc + 1].value, &error);
+            if (error != nullptr) {
+                // Fails at runtime as well, keep it that way
+                delete error;
+                continue;
+            }
+
+            *bytecode[pc].value = result;
+            bytecode[pc + 1] = Instruction(InstructionKind::Nop);
+            bytecode[pc + 2] = Instruction(InstructionKind::Nop);
+            changed = true;
+            continue;
+        }
+
+        // Push addr; JmpO -> Jmp addr
+        if (is_push(bytecode, pc, ObjectKind::U64) && pc + 1 < size && !targets[pc + 1]
+            && bytecode[pc + 1].kind == InstructionKind::JmpO && bytecode[pc].value->data <= size) {
+            bytecode[pc].kind = InstructionKind::Jmp;
+            bytecode[pc + 1] = Instruction(InstructionKind::Nop);
+            targets[bytecode[pc].value->data] = true;
+            changed = true;
+            continue;
+        }
+
+        // Push cond; Push addr; JmpIfO -> Push cond; JmpIf addr
+        if (is_push(bytecode, pc, ObjectKind::Bool) && is_push(bytecode, pc + 1, ObjectKind::U64)
+            && pc + 2 < size && !targets[pc + 1] && !targets[pc + 2]
+            && bytecode[pc + 2].kind == InstructionKind::JmpIfO && bytecode[pc + 1].value->data <= size) {
+            bytecode[pc + 1].kind = InstructionKind::JmpIf;
+            bytecode[pc + 2] = Instruction(InstructionKind::Nop);
+            targets[bytecode[pc + 1].value->data] = true;
+            changed = true;
+            continue;
+        }
+
+        // Push cond; JmpIf addr -> Jmp addr or nothing
+        if (is_push(bytecode, pc, ObjectKind::Bool) && pc + 1 < size && !targets[pc + 1]
+            && bytecode[pc + 1].kind == InstructionKind::JmpIf) {
+            if (bytecode[pc].value->boolean()) {
+                bytecode[pc] = Instruction(InstructionKind::Jmp, new Object(*bytecode[pc + 1].value));
+            } else {
+                bytecode[pc] = Instruction(InstructionKind::Nop);
+            }
+            bytecode[pc + 1] = Instruction(InstructionKind::Nop);
+            changed = true;
+            continue;
+        }
+
+        if (kind == InstructionKind::Jmp || kind == InstructionKind::JmpIf) {
+            u64 target = final_target(bytecode, bytecode[pc].value->data);
+            if (target != bytecode[pc].value->data) {
+                bytecode[pc].value->data = target;
+                targets[target] = true;
+                changed = true;
+            }
+
+            // A jump to the next instruction does nothing, JmpIf still pops
+            // its condition and checks its kind. If the chain from pc + 1
+            // leads back through pc, removing the jump would leave a loop
+            if (kind == InstructionKind::Jmp && final_target(bytecode, pc + 1) == target
+                && !chain_passes(bytecode, pc + 1, pc)) {
+                bytecode[pc] = Instruction(InstructionKind::Nop);
+                changed = true;
+                continue;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Removes all Nops and moves the jump targets. Returns true if anything was
+// removed.
+bool remove_nops(std::vector<Instruction>& bytecode) {
+    // New position of every instruction, the end of the program included.
+    // A removed Nop maps to the instruction after it.
+    std::vector<u64> positions(bytecode.size() + 1, 0);
+    u64 kept = 0;
+    for (u64 pc = 0; pc < bytecode.size(); pc++) {
+        positions[pc] = kept;
+        if (bytecode[pc].kind != InstructionKind::Nop) {
+            kept++;
+        }
+    }
+    positions[bytecode.size()] = kept;
+
+    if (kept == bytecode.size()) {
+        return false;
+    }
+
+    std::vector<Instruction> result{};
+    result.reserve(kept);
+    for (auto& instruction : bytecode) {
+        if (instruction.kind == InstructionKind::Nop) {
+            continue;
+        }
+        if (instruction.kind == InstructionKind::Jmp || instruction.kind == InstructionKind::JmpIf) {
+            instruction.value->data = positions[instruction.value->data];
+        }
+        result.push_back(std::move(instruction));
+    }
+
+    bytecode = std::move(result);
+    return true;
+}
+
+}
+
+void optimize(std::vector<Instruction>& bytecode) {
+    Error *error = nullptr;
+    verify(bytecode, &error);
+    if (error != nullptr) {
+        // Invalid programs have to report their errors when they are executed
+        delete error;
+        return;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = fold(bytecode);
+
+        // The targets of JmpO and JmpIfO are only known at runtime, so the
+        // instructions can not be moved while there is one of them left
+        if (!has_dynamic_jumps(bytecode)) {
+            changed = remove_nops(bytecode) || changed;
+        }
+    }
+}
+
+}
@@ -0,0 +1,254 @@
+#include "rvm.hpp"
+#include "rvm_internal.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <format>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__linux__) && RVM_PROFILE
+#include <csignal>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define RVM_PERF_SUPPORTED 1
+#else
+#define RVM_PERF_SUPPORTED 0
+#endif
+
+namespace rvm {
+
+char const* perf_event_string(PerfEvent event) {
+    switch (event) {
+#define _X(kind, name, ...) case PerfEvent::kind: return name;
+        PERF_EVENT
+#undef _X
+        default:
+            return "INVALID PERF EVENT";
+    }
+}
+
+namespace {
+
+std::vector<u64> const no_samples{};
+
+}
+
+#if RVM_PERF_SUPPORTED
+
+namespace internal {
+
+// The signal handler only sees the sampler through this
+struct PerfHandler {
+    static inline PerfSampler *volatile active = nullptr;
+    static inline struct sigaction previous{};
+
+    static void handle(int, siginfo_t *info, void*) {
+        PerfSampler *sampler = active;
+        if (sampler == nullptr) {
+            return;
+        }
+
+        u64 pc = sampler->vm->profile.current_pc;
+        for (size_t i = 0; i < sampler->fds.size(); i++) {
+            if (sampler->fds[i] != info->si_fd) {
+                continue;
+            }
+            if (pc < sampler->counts[i].size()) {
+                sampler->counts[i][pc]++;
+            }
+            // Every refresh allows a single overflow
+            ioctl(sampler->fds[i], PERF_EVENT_IOC_REFRESH, 1);
+        }
+    }
+};
+
+}
+
+namespace {
+
+u64 default_period(PerfEvent event) {
+    switch (event) {
+#define _X(kind, name, period) case PerfEvent::kind: return period;
+        PERF_EVENT
+#undef _X
+        default:
+            return 0;
+    }
+}
+
+int open_event(PerfEvent event) {
+    perf_event_attr attr{};
+    attr.size = sizeof attr;
+    switch (event) {
+        case PerfEvent::Cycles:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PerfEvent::Instructions:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PerfEvent::BranchMisses:
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PerfEvent::L1dMisses:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PerfEvent::TaskClock:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_TASK_CLOCK;
+            break;
+        case PerfEvent::Last:
+            return -1;
+    }
+    attr.sample_period = default_period(event);
+    attr.wakeup_events = 1;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // Only the calling thread, on any cpu
+    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Deliver the overflows as a signal to this thread, with the fd in
+    // si_fd
+    f_owner_ex owner{F_OWNER_TID, static_cast<pid_t>(syscall(SYS_gettid))};
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGIO) != 0 || fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}
+
+void PerfSampler::start(VM& vm, Error **error) {
+    stop();
+    if (internal::PerfHandler::active != nullptr) {
+        *error = new Error(ErrorKind::ProfilerUnavailable, "another PerfSampler is already running");
+        return;
+    }
+
+    this->vm = &vm;
+    opened.clear();
+    fds.clear();
+    totals.clear();
+    counts.clear();
+    for (u8 i = 0; i < static_cast<u8>(PerfEvent::Last); i++) {
+        auto event = static_cast<PerfEvent>(i);
+        int fd = open_event(event);
+        if (fd >= 0) {
+            opened.push_back(event);
+            fds.push_back(fd);
+        }
+    }
+
+    if (fds.empty()) {
+        *error = new Error(ErrorKind::ProfilerUnavailable, error_concat("perf_event_open failed: ", strerror(errno)));
+        return;
+    }
+
+    totals.assign(fds.size(), 0);
+    // The handler must not allocate, pc can be the end of the program
+    counts.assign(fds.size(), std::vector<u64>(vm.program->size() + 1, 0));
+
+    struct sigaction action{};
+    action.sa_sigaction = internal::PerfHandler::handle;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGIO, &action, &internal::PerfHandler::previous);
+
+    internal::PerfHandler::active = this;
+    running = true;
+    for (int fd : fds) {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+    }
+}
+
+void PerfSampler::stop() {
+    if (!running) {
+        return;
+    }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        u64 value = 0;
+        if (read(fds[i], &value, sizeof value) == sizeof value) {
+            totals[i] = value;
+        }
+    }
+    internal::PerfHandler::active = nullptr;
+    sigaction(SIGIO, &internal::PerfHandler::previous, nullptr);
+    for (int fd : fds) {
+        close(fd);
+    }
+    fds.clear();
+    running = false;
+}
+
+#else
+
+void PerfSampler::start(VM&, Error **error) {
+    *error = new Error(ErrorKind::ProfilerUnavailable, RVM_PROFILE ? "perf_event_open is only available on Linux" : "rvm was built without RVM_PROFILE");
+}
+
+void PerfSampler::stop() {}
+
+#endif
+
+PerfSampler::~PerfSampler() {
+    stop();
+}
+
+std::vector<PerfEvent> const& PerfSampler::events() const {
+    return opened;
+}
+
+u64 PerfSampler::total(PerfEvent event) const {
+    for (size_t i = 0; i < opened.size(); i++) {
+        if (opened[i] == event) {
+            return totals[i];
+        }
+    }
+    return 0;
+}
+
+std::vector<u64> const& PerfSampler::samples(PerfEvent event) const {
+    for (size_t i = 0; i < opened.size(); i++) {
+        if (opened[i] == event) {
+            return counts[i];
+        }
+    }
+    return no_samples;
+}
+
+void PerfSampler::write_folded(FILE *file, Code const& code) const {
+    std::string out{};
+    for (size_t i = 0; i < opened.size(); i++) {
+        for (u64 pc = 0; pc < counts[i].size(); pc++) {
+            if (counts[i][pc] == 0) {
+                continue;
+            }
+            if (pc >= code.size()) {
+                out += std::format("{};end {}\n", perf_event_string(opened[i]), counts[i][pc]);
+                continue;
+            }
+            auto kind = code.fused_kinds.empty() ? code.kinds[pc] : code.fused_kinds[pc];
+            out += std::format("{};{};{} {} {}\n", perf_event_string(opened[i]), instruction_kind_string(kind), pc, code.instruction(pc).string(), counts[i][pc]);
+        }
+    }
+    fwrite(out.data(), 1, out.size(), file);
+}
+
+}
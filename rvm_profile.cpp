@@ -0,0 +1,183 @@
+#include "rvm.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <format>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define RVM_PROFILE_RDTSC 1
+#else
+#define RVM_PROFILE_RDTSC 0
+#endif
+
+namespace rvm {
+
+namespace {
+
+u64 profile_clock() {
+#if RVM_PROFILE_RDTSC
+    return __rdtsc();
+#else
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<u64>(now.tv_sec) * 1000000000 + static_cast<u64>(now.tv_nsec);
+#endif
+}
+
+// Only every sample_period-th instruction is timed, so the total time is
+// the average of the samples times the count
+u64 estimate(u64 count, u64 samples, u64 ticks) {
+    if (samples == 0) {
+        return 0;
+    }
+    return static_cast<u64>(static_cast<double>(ticks) / static_cast<double>(samples) * static_cast<double>(count));
+}
+
+struct Row {
+    std::string name;
+    // The pc for rows of the pc section, unused otherwise
+    u64         pc;
+    u64         count;
+    u64         samples;
+    u64         ticks;
+};
+
+// The end of the program is dispatched like an instruction, but is not one
+std::vector<Row> kind_rows(Profile const& profile) {
+    std::vector<Row> rows{};
+    for (size_t i = 0; i < Profile::kinds; i++) {
+        auto kind = static_cast<InstructionKind>(i);
+        if (kind == InstructionKind::Last || profile.kind_counts[i] == 0) {
+            continue;
+        }
+        rows.push_back(Row{instruction_kind_string(kind), 0, profile.kind_counts[i], profile.kind_samples[i], profile.kind_ticks[i]});
+    }
+    return rows;
+}
+
+std::vector<Row> pc_rows(Profile const& profile, Code const& code) {
+    std::vector<Row> rows{};
+    for (u64 pc = 0; pc < profile.pc_counts.size() && pc < code.size(); pc++) {
+        if (profile.pc_counts[pc] == 0) {
+            continue;
+        }
+        rows.push_back(Row{code.instruction(pc).string(), pc, profile.pc_counts[pc], profile.pc_samples[pc], profile.pc_ticks[pc]});
+    }
+    return rows;
+}
+
+void sort_rows(std::vector<Row>& rows) {
+    std::stable_sort(rows.begin(), rows.end(), [](Row const& lhs, Row const& rhs) {
+        u64 lhs_time = estimate(lhs.count, lhs.samples, lhs.ticks);
+        u64 rhs_time = estimate(rhs.count, rhs.samples, rhs.ticks);
+        if (lhs_time != rhs_time) {
+            return lhs_time > rhs_time;
+        }
+        return lhs.count > rhs.count;
+    });
+}
+
+}
+
+void Profile::grow(u64 pc) {
+    pc_counts.resize(pc + 1, 0);
+    pc_ticks.resize(pc + 1, 0);
+    pc_samples.resize(pc + 1, 0);
+}
+
+void Profile::sample(InstructionKind kind, u64 pc) {
+    u64 now = profile_clock();
+    if (sampling) {
+        // The dispatch of this instruction ends the sampled one
+        kind_ticks[static_cast<u8>(sample_kind)] += now - sample_start;
+        kind_samples[static_cast<u8>(sample_kind)]++;
+        pc_ticks[sample_pc] += now - sample_start;
+        pc_samples[sample_pc]++;
+        sampling = false;
+        countdown = sample_period - 1;
+        return;
+    }
+
+    sampling = true;
+    sample_kind = kind;
+    sample_pc = pc;
+    countdown = 1;
+    // Read last, so the bookkeeping is not measured
+    sample_start = profile_clock();
+}
+
+void Profile::stop() {
+    if (sampling) {
+        sampling = false;
+        countdown = sample_period;
+    }
+}
+
+void Profile::clear() {
+    *this = Profile{};
+}
+
+char const* Profile::clock_unit() {
+    return RVM_PROFILE_RDTSC ? "cycles" : "ns";
+}
+
+void Profile::write_table(FILE *file, Code const& code, size_t rows) const {
+    u64 total = std::accumulate(std::begin(kind_counts), std::end(kind_counts), static_cast<u64>(0))
+        - kind_counts[static_cast<u8>(InstructionKind::Last)];
+
+    auto section = [&](char const *title, std::vector<Row> section_rows, bool with_pc) {
+        sort_rows(section_rows);
+        fprintf(file, "%s\n", title);
+        fprintf(file, "%s", std::format("{:>6} {:<24} {:>14} {:>7} {:>16} {:>10}\n", with_pc ? "pc" : "", "instruction", "count", "%", clock_unit(), "per instr").c_str());
+        for (size_t i = 0; i < section_rows.size() && i < rows; i++) {
+            auto const& row = section_rows[i];
+            u64 time = estimate(row.count, row.samples, row.ticks);
+            double share = total == 0 ? 0.0 : 100.0 * static_cast<double>(row.count) / static_cast<double>(total);
+            double per = row.samples == 0 ? 0.0 : static_cast<double>(row.ticks) / static_cast<double>(row.samples);
+            fprintf(file, "%s", std::format("{:>6} {:<24} {:>14} {:>6.2f}% {:>16} {:>10.1f}\n",
+                with_pc ? std::to_string(row.pc) : "", row.name, row.count, share, time, per).c_str());
+        }
+    };
+
+    fprintf(file, "%s", std::format("{} instructions, 1 in {} timed\n", total, sample_period).c_str());
+    section("by kind:", kind_rows(*this), false);
+    section("by pc:", pc_rows(*this, code), true);
+}
+
+void Profile::write_json(FILE *file, Code const& code) const {
+    auto rows = [&](std::vector<Row> const& section_rows, bool with_pc) {
+        std::string out{};
+        for (size_t i = 0; i < section_rows.size(); i++) {
+            auto const& row = section_rows[i];
+            out += std::format("    {{{}\"name\": \"{}\", \"count\": {}, \"samples\": {}, \"ticks\": {}}}{}\n",
+                with_pc ? std::format("\"pc\": {}, ", row.pc) : "", row.name, row.count, row.samples, row.ticks,
+                i + 1 < section_rows.size() ? "," : "");
+        }
+        return out;
+    };
+
+    std::string out = "{\n";
+    out += std::format("  \"sample_period\": {},\n", sample_period);
+    out += std::format("  \"clock\": \"{}\",\n", clock_unit());
+    out += "  \"kinds\": [\n" + rows(kind_rows(*this), false) + "  ],\n";
+    out += "  \"pcs\": [\n" + rows(pc_rows(*this, code), true) + "  ]\n";
+    out += "}\n";
+    fwrite(out.data(), 1, out.size(), file);
+}
+
+void Profile::write_csv(FILE *file, Code const& code) const {
+    std::string out = "scope,name,pc,count,samples,ticks\n";
+    for (auto const& row : kind_rows(*this)) {
+        out += std::format("kind,{},,{},{},{}\n", row.name, row.count, row.samples, row.ticks);
+    }
+    for (auto const& row : pc_rows(*this, code)) {
+        out += std::format("pc,{},{},{},{},{}\n", row.name, row.pc, row.count, row.samples, row.ticks);
+    }
+    fwrite(out.data(), 1, out.size(), file);
+}
+
+}
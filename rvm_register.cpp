@@ -0,0 +1,268 @@
+#include "rvm.hpp"
+#include "rvm_internal.hpp"
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rvm {
+
+void Code::translate() {
+    constexpr u32 unknown = std::numeric_limits<u32>::max();
+    registers = nullptr;
+
+    // Register operands and jump targets are 32 bit
+    if (!stack_depth_known || size() >= unknown) {
+        return;
+    }
+
+    auto result = std::make_shared<RegisterCode>();
+    auto& out = result->instructions;
+    result->entries.assign(size(), unknown);
+
+    CFG cfg{*this};
+
+    // Constant pushed to a register, which was not loaded yet. 0 if the
+    // register holds its value.
+    std::vector<u32> pending(max_stack_depth, 0);
+    // Jumps to patch once the entries are known, and jumps to the end of
+    // the program with their stack depth
+    std::vector<std::pair<size_t, u64>> jumps{};
+    std::vector<std::pair<size_t, u32>> halts{};
+
+    auto emit = [&](RegisterOp op, u32 dst, u32 lhs, u32 rhs, u32 depth, u64 pc) {
+        out.push_back(RegisterInstruction{op, dst, lhs, rhs, depth, pc});
+    };
+
+    // Loads the pending constants of the registers below depth
+    auto load = [&](u32 depth, u64 pc) {
+        for (u32 i = 0; i < depth; i++) {
+            if (pending[i] != 0) {
+                emit(RegisterOp::Load, i, 0, pending[i], depth, pc);
+                pending[i] = 0;
+            }
+        }
+    };
+
+    auto jump = [&](RegisterOp op, u32 cond, u64 target, u32 depth, u32 depth_after, u64 pc) {
+        if (target >= size()) {
+            halts.push_back({out.size(), depth_after});
+        } else {
+            jumps.push_back({out.size(), target});
+        }
+        emit(op, 0, cond, 0, depth, pc);
+    };
+
+    // Set while the block before can fall through to the current one
+    bool reachable = false;
+    u32 depth = 0;
+
+    for (auto const& block : cfg.blocks) {
+        if (!block.reachable) {
+            reachable = false;
+            continue;
+        }
+
+        // Every way into a block has all constants loaded
+        if (reachable) {
+            load(stack_depths[block.begin], block.begin);
+        }
+        result->entries[block.begin] = out.size();
+        depth = stack_depths[block.begin];
+        reachable = true;
+
+        for (u64 pc = block.begin; pc < block.end; pc++) {
+            u32 index = arguments[pc];
+
+            switch (kinds[pc]) {
+                case InstructionKind::Nop:
+                    break;
+                case InstructionKind::Push:
+                    pending[depth] = index;
+                    break;
+                case InstructionKind::Add:
+                case InstructionKind::Sub: {
+                    bool add = kinds[pc] == InstructionKind::Add;
+                    u32 lhs = depth - 2;
+                    u32 rhs = depth - 1;
+                    // Everything except the right operand is in a register,
+                    // so the stack can be rebuilt if the operation fails
+                    load(rhs, pc);
+                    if (pending[rhs] != 0) {
+                        emit(add ? RegisterOp::AddK : RegisterOp::SubK, lhs, lhs, pending[rhs], depth, pc);
+                        pending[rhs] = 0;
+                    } else {
+                        emit(add ? RegisterOp::Add : RegisterOp::Sub, lhs, lhs, rhs, depth, pc);
+                    }
+                    break;
+                }
+                case InstructionKind::Jmp:
+                    load(depth, pc);
+                    jump(RegisterOp::Jmp, 0, operand(pc)->data, depth, depth, pc);
+                    reachable = false;
+                    break;
+                case InstructionKind::JmpIf:
+                    load(depth, pc);
+                    jump(RegisterOp::JmpIf, depth - 1, operand(pc)->data, depth, depth - 1, pc);
+                    break;
+                case InstructionKind::Alloc:
+                case InstructionKind::Load:
+                case InstructionKind::Store:
+                    // step works on the stack, so every value has to be in
+                    // its register. The register code continues after it.
+                    load(depth, pc);
+                    emit(RegisterOp::Step, 0, 0, 0, depth, pc);
+                    break;
+                default:
+                    // JmpO and JmpIfO, code with a known stack depth has none
+                    registers = nullptr;
+                    return;
+            }
+
+            depth = depth - instruction_pops(kinds[pc]) + instruction_pushes(kinds[pc]);
+        }
+    }
+
+    // Falling off the end of the program
+    if (reachable) {
+        load(depth, size());
+        emit(RegisterOp::Halt, 0, 0, 0, depth, size());
+    }
+
+    for (auto [position, target] : jumps) {
+        out[position].dst = result->entries[target];
+    }
+    for (auto [position, halt_depth] : halts) {
+        out[position].dst = out.size();
+        emit(RegisterOp::Halt, 0, 0, 0, halt_depth, size());
+    }
+
+    registers = std::move(result);
+}
+
+void VM::select(Engine engine) {
+    this->engine = engine;
+    if (engine == Engine::Register && program->registers == nullptr) {
+        program.edit().translate();
+    }
+}
+
+u32 VM::register_entry() const {
+    Code const& code = *program;
+    if (engine != Engine::Register || code.registers == nullptr || pc >= code.size() || stack.size() != code.stack_depths[pc]) {
+        return none;
+    }
+    // entries uses the same marker for instructions inside of a block
+    return code.registers->entries[pc];
+}
+
+RVM_DISPATCH_BEGIN
+
+// Errors are not reported here. The stack is rebuilt for the failing
+// instruction of the stack code, which is then executed by step and
+// reports the error exactly like the stack engine. Counts the dispatches
+// into dispatches if counted is set.
+template <bool counted>
+Status VM::run_registers(u32 entry, u64 *dispatches) {
+    Code const& code = *program;
+    RegisterInstruction const *instructions = code.registers->instructions.data();
+    RegisterInstruction const *i = instructions + entry;
+    Object const *constants = code.constants.data();
+    Object *r = stack.c.data();
+
+#if RVM_THREADED_DISPATCH
+    static void *const labels[] = {
+#define _X(op) &&op_##op,
+        REGISTER_OP
+#undef _X
+    };
+
+#define CASE(op) op_##op: if constexpr (counted) { *dispatches += 1; }
+#define DISPATCH() goto *labels[static_cast<u8>(i->op)]
+
+    DISPATCH();
+    {
+#else
+#define CASE(op) case RegisterOp::op: if constexpr (counted) { *dispatches += 1; }
+#define DISPATCH() continue
+
+    for (;;) {
+        switch (i->op) {
+#endif
+        CASE(Load) {
+            r[i->dst] = constants[i->rhs];
+            i++;
+            DISPATCH();
+        }
+        CASE(Add) {
+            if (!operator_applicable(r[i->lhs], r[i->rhs])) [[unlikely]] goto fail;
+            r[i->dst] = Object(r[i->lhs].kind, r[i->lhs].data + r[i->rhs].data);
+            i++;
+            DISPATCH();
+        }
+        CASE(AddK) {
+            if (!operator_applicable(r[i->lhs], constants[i->rhs])) [[unlikely]] goto fail_constant;
+            r[i->dst] = Object(r[i->lhs].kind, r[i->lhs].data + constants[i->rhs].data);
+            i++;
+            DISPATCH();
+        }
+        CASE(Sub) {
+            if (!operator_applicable(r[i->lhs], r[i->rhs])) [[unlikely]] goto fail;
+            r[i->dst] = Object(r[i->lhs].kind, r[i->lhs].data - r[i->rhs].data);
+            i++;
+            DISPATCH();
+        }
+        CASE(SubK) {
+            if (!operator_applicable(r[i->lhs], constants[i->rhs])) [[unlikely]] goto fail_constant;
+            r[i->dst] = Object(r[i->lhs].kind, r[i->lhs].data - constants[i->rhs].data);
+            i++;
+            DISPATCH();
+        }
+        CASE(Jmp) {
+            i = instructions + i->dst;
+            DISPATCH();
+        }
+        CASE(JmpIf) {
+            Object cond = r[i->lhs];
+            if (cond.kind != ObjectKind::Bool) [[unlikely]] goto fail;
+            i = cond.boolean() ? instructions + i->dst : i + 1;
+            DISPATCH();
+        }
+        CASE(Step) {
+            pc = i->pc;
+            stack.count = i->depth;
+            Status status = step();
+            if (!status.ok()) [[unlikely]] {
+                return status;
+            }
+            i++;
+            DISPATCH();
+        }
+        CASE(Halt) {
+            pc = i->pc;
+            stack.count = i->depth;
+            return Status{StatusKind::Halt, ErrorKind::InvalidObject, InstructionKind::Last, pc, 0};
+        }
+#if !RVM_THREADED_DISPATCH
+        }
+#endif
+    }
+
+#undef CASE
+#undef DISPATCH
+
+fail_constant:
+    // The right operand was never pushed
+    r[i->depth - 1] = constants[i->rhs];
+fail:
+    pc = i->pc;
+    stack.count = i->depth;
+    return step();
+}
+
+RVM_DISPATCH_END
+
+template Status VM::run_registers<false>(u32 entry, u64 *dispatches);
+template Status VM::run_registers<true>(u32 entry, u64 *dispatches);
+
+}
@@ -135,7 +135,7 @@ int main() {
 
     auto screen = ScreenInteractive::Fullscreen();
     auto create_instruction = InstructionBuilder([=](rvm::Instruction i){
-        vm->bytecode.push_back(i);
+        vm->program.edit().push(i);
     });
     auto vms = vm_state(vm);
     screen.Loop(
@@ -156,8 +156,8 @@ int main() {
                 Scroller(Renderer([=] {
                     std::vector<Element> elements{};
 
-                    for (size_t i = 0; i < vm->bytecode.size(); i++) {
-                        elements.push_back(text(std::format("{} - {}", i, vm->bytecode[i].string())));
+                    for (size_t i = 0; i < vm->program->size(); i++) {
+                        elements.push_back(text(std::format("{} - {}", i, vm->program->instruction(i).string())));
                     }
 
                     return vbox(elements) | size(HEIGHT, GREATER_THAN, 0);
@@ -0,0 +1,207 @@
+#include "rvm.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace rvm {
+
+namespace internal {
+
+struct Task {
+    VM                     *vm;
+    // BudgetExhausted until the VM halted or failed
+    Status                  status{StatusKind::BudgetExhausted};
+    bool                    done = false;
+    std::mutex              mutex{};
+    std::condition_variable finished{};
+
+    Task(VM *vm) : vm(vm) {}
+};
+
+struct Worker {
+    // The owner takes VMs from the front and puts them back at the end,
+    // thieves take them from the end
+    std::deque<std::shared_ptr<Task>> runnable{};
+    std::mutex                        mutex{};
+    std::thread                       thread{};
+
+    std::atomic<u64> slices{0};
+    std::atomic<u64> steals{0};
+    std::atomic<u64> completed{0};
+    std::atomic<u64> sleeps{0};
+};
+
+struct SchedulerState {
+    u64                                  slice;
+    std::vector<std::unique_ptr<Worker>> workers{};
+    // Amount of VMs in all deques, the workers sleep while it is 0
+    std::atomic<u64>                     queued{0};
+    std::atomic<u64>                     sleeping{0};
+    std::atomic<u64>                     next{0};
+    std::atomic<bool>                    stopping{false};
+    std::mutex                           mutex{};
+    std::condition_variable              wake{};
+
+    void notify() {
+        // Taking the lock orders the notification after the check of a
+        // worker which is about to sleep
+        std::lock_guard lock{mutex};
+        wake.notify_one();
+    }
+
+    void push(Worker& worker, std::shared_ptr<Task> task) {
+        size_t size;
+        {
+            std::lock_guard lock{worker.mutex};
+            worker.runnable.push_back(std::move(task));
+            size = worker.runnable.size();
+        }
+        queued.fetch_add(1);
+        // A single VM is taken again by its owner, more are worth stealing
+        if (size > 1 && sleeping.load() > 0) {
+            notify();
+        }
+    }
+
+    std::shared_ptr<Task> pop(Worker& worker, bool steal) {
+        std::lock_guard lock{worker.mutex};
+        if (worker.runnable.empty()) {
+            return nullptr;
+        }
+        std::shared_ptr<Task> task{};
+        if (steal) {
+            task = std::move(worker.runnable.back());
+            worker.runnable.pop_back();
+        } else {
+            task = std::move(worker.runnable.front());
+            worker.runnable.pop_front();
+        }
+        queued.fetch_sub(1);
+        return task;
+    }
+
+    // Takes a VM from the own deque or steals one, starting at the next
+    // worker so the victims are spread out
+    std::shared_ptr<Task> take(size_t index) {
+        Worker& self = *workers[index];
+        if (auto task = pop(self, false)) {
+            return task;
+        }
+        for (size_t i = 1; i < workers.size(); i++) {
+            if (auto task = pop(*workers[(index + i) % workers.size()], true)) {
+                self.steals.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    void finish(Task& task, Status status) {
+        std::lock_guard lock{task.mutex};
+        task.status = status;
+        task.done = true;
+        task.finished.notify_all();
+    }
+
+    void run(size_t index) {
+        Worker& self = *workers[index];
+        while (!stopping.load()) {
+            auto task = take(index);
+            if (task == nullptr) {
+                std::unique_lock lock{mutex};
+                sleeping.fetch_add(1);
+                self.sleeps.fetch_add(1, std::memory_order_relaxed);
+                wake.wait(lock, [&] { return stopping.load() || queued.load() > 0; });
+                sleeping.fetch_sub(1);
+                continue;
+            }
+
+            Status status = task->vm->run_for(slice);
+            self.slices.fetch_add(1, std::memory_order_relaxed);
+            if (status.kind == StatusKind::BudgetExhausted) {
+                task->status = status;
+                push(self, std::move(task));
+            } else {
+                self.completed.fetch_add(1, std::memory_order_relaxed);
+                finish(*task, status);
+            }
+        }
+    }
+};
+
+}
+
+Scheduler::Scheduler(size_t workers, u64 slice) : state(std::make_unique<internal::SchedulerState>()) {
+    if (workers == 0) {
+        workers = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    // A slice of 0 would never make progress
+    state->slice = std::max<u64>(slice, 1);
+    for (size_t i = 0; i < workers; i++) {
+        state->workers.push_back(std::make_unique<internal::Worker>());
+    }
+    // Only start once all workers exist, they steal from each other
+    for (size_t i = 0; i < workers; i++) {
+        state->workers[i]->thread = std::thread([this, i] { state->run(i); });
+    }
+}
+
+Scheduler::~Scheduler() {
+    {
+        std::lock_guard lock{state->mutex};
+        state->stopping.store(true);
+        state->wake.notify_all();
+    }
+    for (auto& worker : state->workers) {
+        worker->thread.join();
+    }
+
+    // Wake everyone still waiting for a VM which did not finish
+    for (auto& worker : state->workers) {
+        for (auto& task : worker->runnable) {
+            state->finish(*task, task->status);
+        }
+    }
+}
+
+Scheduler::Ticket Scheduler::submit(VM& vm) {
+    auto task = std::make_shared<internal::Task>(&vm);
+    // Spread new VMs over the workers, stealing balances the rest
+    size_t index = state->next.fetch_add(1, std::memory_order_relaxed) % state->workers.size();
+    state->push(*state->workers[index], task);
+    if (state->sleeping.load() > 0) {
+        state->notify();
+    }
+    return task;
+}
+
+Status Scheduler::await(Ticket const& ticket) {
+    std::unique_lock lock{ticket->mutex};
+    ticket->finished.wait(lock, [&] { return ticket->done; });
+    return ticket->status;
+}
+
+size_t Scheduler::workers() const {
+    return state->workers.size();
+}
+
+std::vector<Scheduler::Statistics> Scheduler::statistics() const {
+    std::vector<Statistics> result{};
+    result.reserve(state->workers.size());
+    for (auto const& worker : state->workers) {
+        result.push_back(Statistics{
+            worker->slices.load(std::memory_order_relaxed),
+            worker->steals.load(std::memory_order_relaxed),
+            worker->completed.load(std::memory_order_relaxed),
+            worker->sleeps.load(std::memory_order_relaxed),
+        });
+    }
+    return result;
+}
+
+}
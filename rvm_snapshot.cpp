@@ -0,0 +1,141 @@
+#include "rvm.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <format>
+#include <string>
+#include <vector>
+
+namespace rvm {
+
+namespace {
+
+constexpr char magic[4] = {'R', 'V', 'M', 'S'};
+constexpr u16  version = 2;
+
+struct SnapshotHeader {
+    char magic[4];
+    u16  version;
+    u16  reserved;
+    u32  reserved2;
+    u64  pc;
+    u64  stack_size;
+    u64  heap_size;
+};
+
+static_assert(sizeof(SnapshotHeader) == 40);
+static_assert(offsetof(Object, kind) == 0 && offsetof(Object, data) == 8 && sizeof(Object) == 16, "snapshots store Objects as they are laid out in memory");
+
+// Copies count Objects to out field by field, so the padding is written as
+// zeroes. Returns the end of the copy.
+u8 *write_objects(u8 *out, Object const *objects, u64 count) {
+    for (u64 i = 0; i < count; i++, out += sizeof(Object)) {
+        memcpy(out + offsetof(Object, kind), &objects[i].kind, sizeof objects[i].kind);
+        memcpy(out + offsetof(Object, data), &objects[i].data, sizeof objects[i].data);
+    }
+    return out;
+}
+
+void snapshot_error(Error **error, std::string message) {
+    *error = new Error(ErrorKind::InvalidSnapshot, strdup(message.c_str()), true);
+}
+
+}
+
+VM VM::clone() const {
+    return *this;
+}
+
+std::vector<u8> VM::snapshot() const {
+    SnapshotHeader header{};
+    memcpy(header.magic, magic, sizeof magic);
+    header.version = version;
+    header.pc = pc;
+    header.stack_size = stack.count;
+    header.heap_size = heap.used();
+
+    // Zeroed, write_objects leaves the padding alone
+    std::vector<u8> blob(sizeof header + (stack.count + heap.used()) * sizeof(Object));
+    u8 *out = blob.data();
+    memcpy(out, &header, sizeof header);
+    out = write_objects(out + sizeof header, stack.c.data(), stack.count);
+    write_objects(out, heap.data(), heap.used());
+    return blob;
+}
+
+void VM::restore(std::span<u8 const> blob, Error **error) {
+    SnapshotHeader header;
+    if (blob.size() < sizeof header) {
+        snapshot_error(error, "snapshot is too small for its header");
+        return;
+    }
+    memcpy(&header, blob.data(), sizeof header);
+
+    if (memcmp(header.magic, magic, sizeof magic) != 0) {
+        snapshot_error(error, "not a snapshot, the magic number is missing");
+        return;
+    }
+    if (header.version != version) {
+        snapshot_error(error, std::format("unsupported snapshot version {}, expected {}", header.version, version));
+        return;
+    }
+
+    u64 objects = (blob.size() - sizeof header) / sizeof(Object);
+    if ((blob.size() - sizeof header) % sizeof(Object) != 0 || header.stack_size > objects || header.heap_size != objects - header.stack_size) {
+        snapshot_error(error, std::format("snapshot has {} bytes, which do not match {} stack and {} heap values", blob.size(), header.stack_size, header.heap_size));
+        return;
+    }
+    if (header.pc > program->size()) {
+        snapshot_error(error, std::format("snapshot pc {} is outside of the program with {} instructions", header.pc, program->size()));
+        return;
+    }
+
+    // The kind is the first byte of every Object, so it is checked in place
+    u8 const *values = blob.data() + sizeof header;
+    auto kind = [&](u64 i) {
+        return values[i * sizeof(Object)];
+    };
+    for (u64 i = 0; i < header.stack_size; i++) {
+        if (kind(i) >= static_cast<u8>(ObjectKind::Last)) {
+            snapshot_error(error, std::format("snapshot value {} has the invalid object kind {}", i, kind(i)));
+            return;
+        }
+    }
+
+    // The heap is a sequence of headers, each followed by as many values as
+    // it says
+    u8 const *heap_values = values + header.stack_size * sizeof(Object);
+    for (u64 i = header.stack_size, size = 0; i < objects; i += size + 1) {
+        if (kind(i) != static_cast<u8>(ObjectKind::Last)) {
+            snapshot_error(error, std::format("snapshot heap value {} should be an object header", i - header.stack_size));
+            return;
+        }
+        memcpy(&size, values + i * sizeof(Object) + offsetof(Object, data), sizeof size);
+        if (size > objects - i - 1) {
+            snapshot_error(error, std::format("snapshot heap object at {} with {} values does not fit into the heap", i - header.stack_size, size));
+            return;
+        }
+        for (u64 j = i + 1; j <= i + size; j++) {
+            if (kind(j) >= static_cast<u8>(ObjectKind::Last)) {
+                snapshot_error(error, std::format("snapshot heap value {} has the invalid object kind {}", j - header.stack_size, kind(j)));
+                return;
+            }
+        }
+    }
+
+    // The only step which can fail, so it goes first
+    if (!heap.assign(heap_values, header.heap_size)) {
+        *error = new Error(ErrorKind::OutOfMemory, strdup(std::format("snapshot heap of {} values does not fit into the heap limit of {} bytes", header.heap_size, heap.limit).c_str()), true);
+        return;
+    }
+    pc = header.pc;
+    // Any depth can be resumed, the engines only skip stack checks when it
+    // matches the depth the analysis found at pc
+    stack.reserve(std::max<u64>(header.stack_size, program->max_stack_depth));
+    stack.count = header.stack_size;
+    if (header.stack_size > 0) {
+        memcpy(stack.c.data(), values, header.stack_size * sizeof(Object));
+    }
+}
+
+}
@@ -0,0 +1,162 @@
+#include "rvm.hpp"
+#include <cstring>
+#include <format>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace rvm {
+
+// Checks a single instruction of a program with size instructions
+static void verify_instruction(u64 pc, u64 size, InstructionKind kind, Object const *value, Error **error) {
+    check_instruction(kind, value, error);
+    if (*error != nullptr) {
+        std::string message = std::format("instruction {}: {}", pc, (*error)->what());
+        delete *error;
+        *error = new Error(ErrorKind::InvalidInstruction, strdup(message.c_str()), true);
+        return;
+    }
+
+    switch (kind) {
+        case InstructionKind::Jmp:
+        case InstructionKind::JmpIf: {
+            u64 target = value->data;
+            if (target > size) {
+                *error = new Error(ErrorKind::InvalidInstructionArgument, strdup(std::format("instruction {}: jump target {} is outside of the program", pc, target).c_str()), true);
+            }
+            return;
+        }
+        default:
+            return;
+    }
+}
+
+void verify(std::vector<Instruction> const& bytecode, Error **error) {
+    for (u64 pc = 0; pc < bytecode.size(); pc++) {
+        verify_instruction(pc, bytecode.size(), bytecode[pc].kind, bytecode[pc].value, error);
+        if (*error != nullptr) {
+            return;
+        }
+    }
+}
+
+void Code::verify(Error **error) {
+    verified = false;
+
+    for (u64 pc = 0; pc < size(); pc++) {
+        verify_instruction(pc, size(), kinds[pc], operand(pc), error);
+        if (*error != nullptr) {
+            return;
+        }
+    }
+
+    verified = true;
+}
+
+void Code::analyze_stack() {
+    constexpr u32 unknown = std::numeric_limits<u32>::max();
+
+    stack_depth_known = false;
+    max_stack_depth = 0;
+    stack_depths.clear();
+    fuel.clear();
+
+    if (!verified) {
+        return;
+    }
+
+    for (auto kind : kinds) {
+        if (kind == InstructionKind::JmpO || kind == InstructionKind::JmpIfO) {
+            return;
+        }
+    }
+
+    stack_depths.assign(size(), unknown);
+    if (size() == 0) {
+        compute_fuel();
+        stack_depth_known = true;
+        return;
+    }
+
+    std::vector<u64> worklist{0};
+    stack_depths[0] = 0;
+    u64 max_depth = 0;
+
+    // Propagates the depth to a successor. Returns false if the successor
+    // was already reached with a different depth.
+    auto flow = [&](u64 target, u64 depth) {
+        if (target >= size()) {
+            // Leaving the program ends it
+            return true;
+        }
+        if (stack_depths[target] == unknown) {
+            stack_depths[target] = static_cast<u32>(depth);
+            worklist.push_back(target);
+            return true;
+        }
+        return stack_depths[target] == depth;
+    };
+
+    while (!worklist.empty()) {
+        u64 pc = worklist.back();
+        worklist.pop_back();
+
+        InstructionKind kind = kinds[pc];
+        u64 depth = stack_depths[pc];
+        if (depth < instruction_pops(kind)) {
+            stack_depths.clear();
+            return;
+        }
+
+        depth = depth - instruction_pops(kind) + instruction_pushes(kind);
+        if (depth >= unknown) {
+            stack_depths.clear();
+            return;
+        }
+        if (depth > max_depth) {
+            max_depth = depth;
+        }
+
+        bool consistent = true;
+        switch (kind) {
+            case InstructionKind::Jmp:
+                consistent = flow(operand(pc)->data, depth);
+                break;
+            case InstructionKind::JmpIf:
+                consistent = flow(operand(pc)->data, depth)
+                          && flow(pc + 1, depth);
+                break;
+            default:
+                consistent = flow(pc + 1, depth);
+                break;
+        }
+
+        if (!consistent) {
+            stack_depths.clear();
+            return;
+        }
+    }
+
+    max_stack_depth = max_depth;
+    compute_fuel();
+    stack_depth_known = true;
+}
+
+// Runs end at the next jump and not at the end of a CFG block: falling
+// through to a jump target charges nothing, see CHARGE in run_verified
+void Code::compute_fuel() {
+    fuel.assign(size() + 1, 0);
+    for (u64 pc = size(); pc-- > 0;) {
+        InstructionKind kind = kinds[pc];
+        if (kind == InstructionKind::Jmp || kind == InstructionKind::JmpIf) {
+            fuel[pc] = 1;
+        } else if (fuel[pc + 1] < std::numeric_limits<u32>::max()) {
+            fuel[pc] = fuel[pc + 1] + 1;
+        } else {
+            // Charging too much only stops the program earlier
+            fuel[pc] = fuel[pc + 1];
+        }
+    }
+}
+
+}
@@ -1,4 +1,5 @@
 #include "rvm.hpp"
+#include <algorithm>
 #include <cerrno>
 #include <csetjmp>
 #include <csignal>
@@ -8,9 +9,11 @@
 #include <exception>
 #include <functional>
 #include <iostream>
+#include <optional>
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <unistd.h>
 #include <vector>
 #include <format>
 
@@ -133,6 +136,1145 @@ int add_2_values(Context *ctx) {
     return 0;
 }
 
+int verify_jump_targets(Context *ctx) {
+    ctx->begin("verify_jump_targets");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+    };
+
+    rvm::Error *error = nullptr;
+    rvm::verify(instructions, &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidInstructionArgument);
+    delete error;
+    error = nullptr;
+
+    rvm::VM invalid{instructions};
+    ASSERT(!invalid.program->verified);
+
+    instructions[1] = { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} };
+    rvm::verify(instructions, &error);
+    HANDLE_ERROR(error, "unexpected verify error: ");
+
+    rvm::VM valid{instructions};
+    ASSERT(valid.program->verified);
+    return 0;
+}
+
+int stack_depth_analysis(Context *ctx) {
+    ctx->begin("stack_depth_analysis");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(6)} },
+        rvm::InstructionKind::Nop,
+        rvm::InstructionKind::Nop,
+    };
+
+    rvm::VM vm{instructions};
+    ASSERT(vm.program->stack_depth_known);
+    ASSERT(vm.program->max_stack_depth == 2);
+    ASSERT(vm.program->stack_depths[6] == 1);
+
+    rvm::VM underflow{{ rvm::InstructionKind::Add }};
+    ASSERT(!underflow.program->stack_depth_known);
+
+    rvm::Error *error = nullptr;
+    underflow.tick(&error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::StackUnderflow);
+    delete error;
+
+    // The error leaves the stack shallower than the analysis expects, so
+    // running again has to check every instruction
+    rvm::VM failed{std::vector<rvm::Instruction>{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+    }};
+    ASSERT(failed.program->stack_depth_known);
+    auto status = failed.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::InvalidOperator);
+    status = failed.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::StackUnderflow);
+    return 0;
+}
+
+int run_until_halt(Context *ctx) {
+    ctx->begin("run_until_halt");
+    // Adds 1 to the counter until the jump at 6 is taken, which it never is
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+
+    rvm::VM vm{instructions};
+
+    auto status = vm.run_for(4 * 10 + 1);
+    ASSERT(status.kind == rvm::StatusKind::BudgetExhausted);
+    ASSERT(vm.pc == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(10)}));
+
+    rvm::VM halting{{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Sub,
+    }};
+    status = halting.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(halting.stack.size() == 1);
+    ASSERT(halting.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)}));
+
+    rvm::VM failing{{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+    }};
+    status = failing.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::InvalidOperator);
+    ASSERT(status.pc == 2);
+    ASSERT(status.what() == "operators not supported for Bool");
+    ASSERT(failing.pc == 3);
+    return 0;
+}
+
+int container_round_trip(Context *ctx) {
+    ctx->begin("container_round_trip");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(38)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)} },
+        rvm::InstructionKind::Nop,
+    };
+
+    char path[] = "/tmp/rvm-tests-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        ctx->fail(std::format("could not create file because {}", strerror(errno)));
+        return 2;
+    }
+    close(fd);
+    defer(remove(path));
+
+    rvm::Error *error = nullptr;
+    {
+        FILE *file = fopen(path, "wb");
+        ASSERT(file != nullptr);
+        rvm::write_bytecode(file, instructions, &error);
+        fclose(file);
+        HANDLE_ERROR(error, "failed to write container: ");
+    }
+
+    auto bytecode = rvm::bytecode_from_file(path, &error);
+    HANDLE_ERROR(error, "error while parsing container: ");
+    ASSERT(bytecode == instructions);
+
+    rvm::VM vm{rvm::code_from_file(path, &error)};
+    HANDLE_ERROR(error, "error while mapping container: ");
+    ASSERT(vm.program->size() == instructions.size());
+    // The empty constant, 38, 2 and 7
+    ASSERT(vm.program->constants.size() == 4);
+    ASSERT(vm.program->verified);
+
+    auto status = vm.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+
+    // Starting with 'R' is not enough, the whole magic number has to match
+    {
+        FILE *file = fopen(path, "r+b");
+        ASSERT(file != nullptr);
+        fseek(file, 3, SEEK_SET);
+        fputc('X', file);
+        fclose(file);
+    }
+    rvm::bytecode_from_file(path, &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidContainer);
+    delete error;
+    error = nullptr;
+    rvm::code_from_file(path, &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidContainer);
+    delete error;
+    return 0;
+}
+
+int varint_round_trip(Context *ctx) {
+    ctx->begin("varint_round_trip");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(40)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, false} },
+        // Backwards, never taken
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)} },
+        rvm::InstructionKind::Nop,
+    };
+    rvm::Code code{instructions};
+
+    char fixed_path[] = "/tmp/rvm-tests-XXXXXX";
+    char varint_path[] = "/tmp/rvm-tests-XXXXXX";
+    int fixed_fd = mkstemp(fixed_path);
+    int varint_fd = mkstemp(varint_path);
+    if (fixed_fd < 0 || varint_fd < 0) {
+        ctx->fail(std::format("could not create file because {}", strerror(errno)));
+        return 2;
+    }
+    close(fixed_fd);
+    close(varint_fd);
+    defer(remove(fixed_path));
+    defer(remove(varint_path));
+
+    rvm::Error *error = nullptr;
+    long sizes[2] = {};
+    char *paths[2] = {fixed_path, varint_path};
+    rvm::Encoding encodings[2] = {rvm::Encoding::Fixed, rvm::Encoding::Varint};
+    for (int i = 0; i < 2; i++) {
+        FILE *file = fopen(paths[i], "wb");
+        ASSERT(file != nullptr);
+        rvm::write_code(file, code, encodings[i], &error);
+        sizes[i] = ftell(file);
+        fclose(file);
+        HANDLE_ERROR(error, "failed to write container: ");
+    }
+    ASSERT(sizes[1] < sizes[0]);
+
+    auto bytecode = rvm::bytecode_from_file(varint_path, &error);
+    HANDLE_ERROR(error, "error while parsing container: ");
+    ASSERT(bytecode == instructions);
+
+    rvm::VM vm{rvm::code_from_file(varint_path, &error)};
+    HANDLE_ERROR(error, "error while decoding container: ");
+    ASSERT(vm.program->size() == instructions.size());
+    ASSERT(vm.program->verified);
+    // The jump targets are rebuilt instead of being read
+    ASSERT(vm.program->constants.size() == code.constants.size());
+
+    auto status = vm.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+    return 0;
+}
+
+int optimize_peephole(Context *ctx) {
+    ctx->begin("optimize_peephole");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(38)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        rvm::InstructionKind::Nop,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(8)} },
+        rvm::InstructionKind::JmpO,
+        // Jump chain to the end of the program
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(10)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(11)} },
+    };
+
+    rvm::optimize(instructions);
+    std::vector<rvm::Instruction> expected{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)} },
+    };
+    ASSERT(instructions == expected);
+
+    // Operands of the wrong kind fail at runtime, they are not folded
+    std::vector<rvm::Instruction> invalid{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+    };
+    auto unchanged = invalid;
+    rvm::optimize(invalid);
+    ASSERT(invalid == unchanged);
+
+    // A loop is kept, only the Nop is removed and its target moved
+    std::vector<rvm::Instruction> loop{
+        rvm::InstructionKind::Nop,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, false} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+    };
+    rvm::optimize(loop);
+    std::vector<rvm::Instruction> expected_loop{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+    };
+    ASSERT(loop == expected_loop);
+
+    // A loop which is never entered is removed, although it is jumped to
+    std::vector<rvm::Instruction> dead{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(4)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        rvm::InstructionKind::Nop,
+    };
+    rvm::optimize(dead);
+    std::vector<rvm::Instruction> expected_dead{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+    ASSERT(dead == expected_dead);
+
+    // JmpO can jump into the middle of any pattern. The target of the
+    // first one is only known at runtime, the second one always jumps to 4.
+    auto u64 = [](rvm::u64 value) { return new rvm::Object{rvm::ObjectKind::U64, value}; };
+    std::vector<std::vector<rvm::Instruction>> dynamic_jumps{
+        {
+            { rvm::InstructionKind::Push, u64(10) },
+            { rvm::InstructionKind::Push, u64(3) },
+            { rvm::InstructionKind::Push, u64(3) },
+            rvm::InstructionKind::Add,
+            rvm::InstructionKind::JmpO,
+            { rvm::InstructionKind::Push, u64(1) },
+            { rvm::InstructionKind::Push, u64(2) },
+            rvm::InstructionKind::Add,
+        },
+        {
+            { rvm::InstructionKind::Push, u64(10) },
+            { rvm::InstructionKind::Push, u64(4) },
+            rvm::InstructionKind::JmpO,
+            { rvm::InstructionKind::Push, u64(5) },
+            { rvm::InstructionKind::Push, u64(2) },
+            rvm::InstructionKind::Add,
+        },
+    };
+    for (auto& dynamic : dynamic_jumps) {
+        rvm::VM before{dynamic};
+        rvm::optimize(dynamic);
+        rvm::VM after{dynamic};
+        auto status = before.run();
+        ASSERT(status.kind == rvm::StatusKind::Halt);
+        ASSERT(after.run().kind == status.kind);
+        ASSERT(before.stack.size() == 1 && after.stack.size() == 1);
+        ASSERT(before.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(12)}));
+        ASSERT(after.stack.top()->same(*before.stack.top()));
+    }
+
+    // The chain from the Jmp after JmpIf leads back through it, so it is not
+    // a jump to the next instruction. The budget catches a folded loop.
+    std::vector<rvm::Instruction> back{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, u64(3) },
+        { rvm::InstructionKind::Jmp, u64(4) },
+        { rvm::InstructionKind::Jmp, u64(2) },
+        { rvm::InstructionKind::Push, u64(1) },
+    };
+    rvm::VM before_back{back};
+    rvm::optimize(back);
+    rvm::VM after_back{back};
+    ASSERT(before_back.run().kind == rvm::StatusKind::Halt);
+    ASSERT(after_back.run_for(100).kind == rvm::StatusKind::Halt);
+    ASSERT(before_back.stack.size() == 1 && after_back.stack.size() == 1);
+    ASSERT(before_back.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)}));
+    ASSERT(after_back.stack.top()->same(*before_back.stack.top()));
+    return 0;
+}
+
+int superinstructions(Context *ctx) {
+    ctx->begin("superinstructions");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(45)} },
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1000)} },
+        // Jumped to, the second instruction of a PushPush
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        rvm::InstructionKind::Sub,
+    };
+
+    rvm::VM vm{instructions};
+    ASSERT(vm.program->fused_kinds.size() == vm.program->kinds.size());
+    ASSERT(vm.program->fused_kinds[2] == rvm::InstructionKind::PushPush);
+    ASSERT(vm.program->fused_kinds[3] == rvm::InstructionKind::PushSub);
+    ASSERT(vm.program->kinds[3] == rvm::InstructionKind::Push);
+
+    auto status = vm.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(vm.stack.size() == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+
+    // Errors are reported like without superinstructions
+    std::vector<rvm::Instruction> invalid{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+    };
+    rvm::VM fused{invalid};
+    rvm::VM unfused{invalid};
+    unfused.program.edit().fused_kinds.clear();
+
+    auto fused_status = fused.run();
+    auto unfused_status = unfused.run();
+    ASSERT(fused_status.kind == rvm::StatusKind::Error);
+    ASSERT(fused_status.instruction == unfused_status.instruction);
+    ASSERT(fused_status.pc == unfused_status.pc);
+    ASSERT(fused_status.operand == unfused_status.operand);
+    ASSERT(fused.pc == unfused.pc);
+    ASSERT(fused.stack.size() == unfused.stack.size());
+    return 0;
+}
+
+int jit_matches_interpreter(Context *ctx) {
+    ctx->begin("jit_matches_interpreter");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(45)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(4)} },
+        rvm::InstructionKind::Nop,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        rvm::InstructionKind::Sub,
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(9)} },
+        rvm::InstructionKind::Nop,
+        rvm::InstructionKind::Nop,
+    };
+
+    rvm::VM vm{instructions};
+    vm.program.edit().compile();
+#if defined(__x86_64__) && defined(__unix__)
+    ASSERT(vm.program->jit != nullptr);
+#endif
+    auto status = vm.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(vm.pc == instructions.size());
+    ASSERT(vm.stack.size() == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+
+    // The native code stops before the failing Add, the interpreter reports it
+    std::vector<rvm::Instruction> invalid{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+    };
+    rvm::VM compiled{invalid};
+    compiled.program.edit().compile();
+    rvm::VM interpreted{invalid};
+
+    auto compiled_status = compiled.run();
+    rvm::Status interpreted_status{};
+    while (interpreted_status.ok()) {
+        interpreted_status = interpreted.step();
+    }
+    ASSERT(compiled_status.kind == rvm::StatusKind::Error);
+    ASSERT(compiled_status.error == interpreted_status.error);
+    ASSERT(compiled_status.pc == interpreted_status.pc);
+    ASSERT(compiled_status.operand == interpreted_status.operand);
+    ASSERT(compiled.pc == interpreted.pc);
+    ASSERT(compiled.stack.size() == interpreted.stack.size());
+
+    // Deeper than the registers caching the top of the stack. The failing
+    // Sub leaves the registers on the stack, and VM::run steps until it can
+    // enter the native code again if it starts in the middle of a block.
+    std::vector<rvm::Instruction> deep{};
+    for (rvm::u64 i = 0; i < 12; i++) {
+        deep.push_back({ rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, i} });
+    }
+    deep.push_back({ rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} });
+    deep.push_back({ rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(14)} });
+    for (rvm::u64 i = 0; i < 10; i++) {
+        deep.push_back(i % 2 == 0 ? rvm::InstructionKind::Add : rvm::InstructionKind::Sub);
+    }
+    deep.push_back({ rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Pointer, static_cast<rvm::u64>(0)} });
+    deep.push_back(rvm::InstructionKind::Sub);
+    for (rvm::u64 start : {0, 3, 16}) {
+        rvm::VM native{deep};
+        native.program.edit().compile();
+        rvm::VM stepped{deep};
+        for (rvm::u64 i = 0; i < start; i++) {
+            ASSERT(native.step().ok());
+            ASSERT(stepped.step().ok());
+        }
+        auto native_status = native.run();
+        rvm::Status stepped_status{};
+        while (stepped_status.ok()) {
+            stepped_status = stepped.step();
+        }
+        ASSERT(native_status.kind == rvm::StatusKind::Error);
+        ASSERT(native_status.error == stepped_status.error);
+        ASSERT(native_status.pc == stepped_status.pc);
+        ASSERT(native.pc == stepped.pc);
+        ASSERT(native.stack.size() == stepped.stack.size());
+        for (size_t i = 0; i < native.stack.size(); i++) {
+            ASSERT(native.stack[i].same(stepped.stack[i]));
+        }
+    }
+    return 0;
+}
+
+int register_engine(Context *ctx) {
+    ctx->begin("register_engine");
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(45)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(4)} },
+        rvm::InstructionKind::Nop,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        rvm::InstructionKind::Sub,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)} },
+        rvm::InstructionKind::Sub,
+        rvm::InstructionKind::Add,
+    };
+
+    rvm::VM vm{instructions};
+    vm.select(rvm::Engine::Register);
+    ASSERT(vm.program->registers != nullptr);
+    // The pushes of constants are not executed
+    ASSERT(vm.program->registers->instructions.size() < instructions.size());
+
+    auto status = vm.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(vm.pc == instructions.size());
+    ASSERT(vm.stack.size() == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+
+    // The stack engine dispatches 9 instructions and the end, PushPush and
+    // PushSub combine three pairs of them
+    rvm::u64 register_dispatches = 0;
+    rvm::u64 stack_dispatches = 0;
+    rvm::VM counted_registers{vm.program};
+    counted_registers.select(rvm::Engine::Register);
+    rvm::VM counted_stack{vm.program};
+    ASSERT(counted_registers.run_counting(&register_dispatches).kind == rvm::StatusKind::Halt);
+    ASSERT(counted_stack.run_counting(&stack_dispatches).kind == rvm::StatusKind::Halt);
+    ASSERT(stack_dispatches == 7);
+#if RVM_PROFILE
+    ASSERT(register_dispatches == stack_dispatches);
+#else
+    // Every register instruction is executed once, Halt included
+    ASSERT(register_dispatches == vm.program->registers->instructions.size());
+#endif
+    ASSERT(counted_registers.stack.top()->same(*vm.stack.top()));
+    ASSERT(counted_stack.stack.top()->same(*vm.stack.top()));
+
+    // The constant operand of the failing Add is back on the stack
+    std::vector<rvm::Instruction> invalid{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+    };
+    rvm::VM registers{invalid};
+    registers.select(rvm::Engine::Register);
+    rvm::VM stack{invalid};
+
+    auto register_status = registers.run();
+    auto stack_status = stack.run();
+    ASSERT(register_status.kind == rvm::StatusKind::Error);
+    ASSERT(register_status.error == stack_status.error);
+    ASSERT(register_status.pc == stack_status.pc);
+    ASSERT(register_status.operand == stack_status.operand);
+    ASSERT(registers.pc == stack.pc);
+    ASSERT(registers.stack.size() == stack.stack.size());
+    ASSERT(registers.stack[0].same(stack.stack[0]));
+    return 0;
+}
+
+int control_flow_graph(Context *ctx) {
+    ctx->begin("control_flow_graph");
+    std::vector<rvm::Instruction> instructions{
+        // Block 0
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(4)} },
+        // Block 1
+        rvm::InstructionKind::Nop,
+        { rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(5)} },
+        // Block 2
+        rvm::InstructionKind::Nop,
+        // Block 3, the loop back to block 2 is never left
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(4)} },
+        // Block 4
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(9)} },
+        rvm::InstructionKind::JmpO,
+        // Block 5, only reachable through JmpO
+        rvm::InstructionKind::Nop,
+    };
+
+    rvm::CFG cfg{instructions};
+    ASSERT(cfg.blocks.size() == 6);
+    ASSERT(cfg.dynamic_jumps);
+    ASSERT(cfg.block(5) == 3);
+    ASSERT(cfg.block(instructions.size()) == rvm::CFG::none);
+    ASSERT(cfg.blocks[3].begin == 5 && cfg.blocks[3].end == 7);
+
+    ASSERT((cfg.blocks[0].successors == std::vector<rvm::u32>{2, 1}));
+    ASSERT((cfg.blocks[2].predecessors == std::vector<rvm::u32>{0, 3}));
+    ASSERT((cfg.blocks[3].predecessors == std::vector<rvm::u32>{1, 2}));
+    ASSERT(cfg.blocks[4].successors.empty());
+
+    ASSERT(cfg.blocks[4].reachable);
+    ASSERT(!cfg.blocks[5].reachable && cfg.blocks[5].dynamic);
+
+    ASSERT(cfg.blocks[0].immediate_dominator == rvm::CFG::none);
+    ASSERT(cfg.blocks[1].immediate_dominator == 0);
+    ASSERT(cfg.blocks[2].immediate_dominator == 0);
+    ASSERT(cfg.blocks[3].immediate_dominator == 0);
+    ASSERT(cfg.blocks[4].immediate_dominator == 3);
+    ASSERT(cfg.dominates(0, 4));
+    ASSERT(cfg.dominates(3, 4));
+    ASSERT(!cfg.dominates(2, 3));
+    ASSERT(!cfg.dominates(0, 5));
+
+    rvm::CFG from_code{rvm::Code(instructions)};
+    ASSERT(from_code.blocks.size() == cfg.blocks.size());
+    return 0;
+}
+
+int fuel_metering(Context *ctx) {
+    ctx->begin("fuel_metering");
+    // Counts to 3 and stops, the loop body is a single block
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+
+    rvm::VM vm{instructions};
+    ASSERT((vm.program->fuel == std::vector<rvm::u32>{5, 4, 3, 2, 1, 0}));
+
+    // A block runs as long as there was fuel left when it was entered
+    auto status = vm.run_for(5 + 4);
+    ASSERT(status.kind == rvm::StatusKind::BudgetExhausted);
+    ASSERT(vm.pc == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)}));
+
+    // Every call runs at least one block, however small the budget
+    status = vm.run_for(1);
+    ASSERT(status.kind == rvm::StatusKind::BudgetExhausted);
+    ASSERT(vm.pc == 1);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)}));
+
+    // A block which ends the program is charged like any other
+    rvm::VM halting{{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Sub,
+    }};
+    status = halting.run_for(1);
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(halting.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)}));
+    return 0;
+}
+
+int scheduler(Context *ctx) {
+    ctx->begin("scheduler");
+    // Adds 1 a thousand times, so every VM needs many slices. The jumps to
+    // the next instruction keep the blocks short, the fuel of a whole block
+    // is charged at once.
+    std::vector<rvm::Instruction> counting{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+    };
+    for (int i = 0; i < 1000; i++) {
+        counting.push_back({ rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} });
+        counting.push_back(rvm::InstructionKind::Add);
+        counting.push_back({ rvm::InstructionKind::Jmp, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(counting.size() + 1)} });
+    }
+
+    std::vector<rvm::VM> vms{};
+    for (int i = 0; i < 64; i++) {
+        vms.emplace_back(counting);
+    }
+    rvm::VM failing{{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+    }};
+
+    rvm::Scheduler scheduler{4, 16};
+    ASSERT(scheduler.workers() == 4);
+    std::vector<rvm::Scheduler::Ticket> tickets{};
+    for (auto& vm : vms) {
+        tickets.push_back(scheduler.submit(vm));
+    }
+    auto failed = scheduler.submit(failing);
+
+    for (size_t i = 0; i < vms.size(); i++) {
+        auto status = scheduler.await(tickets[i]);
+        ASSERT(status.kind == rvm::StatusKind::Halt);
+        ASSERT(vms[i].stack.size() == 1);
+        ASSERT(vms[i].stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1000)}));
+    }
+    auto status = scheduler.await(failed);
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::InvalidOperator);
+
+    rvm::u64 slices = 0;
+    rvm::u64 completed = 0;
+    for (auto const& worker : scheduler.statistics()) {
+        slices += worker.slices;
+        completed += worker.completed;
+    }
+    ASSERT(completed == vms.size() + 1);
+    ASSERT(slices > vms.size() * 100);
+    return 0;
+}
+
+int shared_program(Context *ctx) {
+    ctx->begin("shared_program");
+    rvm::Program program{{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(3)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Sub,
+    }};
+    ASSERT(program->verified);
+    ASSERT(program->stack_depth_known);
+
+    std::vector<rvm::VM> vms{};
+    for (int i = 0; i < 8; i++) {
+        vms.emplace_back(program);
+    }
+    ASSERT(program.use_count() == 9);
+    ASSERT(&*vms[0].program == &*program);
+
+    for (auto& vm : vms) {
+        auto status = vm.run();
+        ASSERT(status.kind == rvm::StatusKind::Halt);
+        ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(2)}));
+    }
+
+    // Changing the code of one VM leaves the others alone
+    vms[0].program.edit().push(rvm::Instruction(rvm::InstructionKind::Nop));
+    ASSERT(&*vms[0].program != &*program);
+    ASSERT(vms[0].program->size() == 4);
+    ASSERT(!vms[0].program->verified);
+    ASSERT(program->size() == 3);
+    ASSERT(program->verified);
+    ASSERT(program.use_count() == 8);
+    return 0;
+}
+
+int snapshot_restore(Context *ctx) {
+    ctx->begin("snapshot_restore");
+    // Adds 1 to the counter forever
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+
+    rvm::VM vm{instructions};
+    auto object = vm.heap.allocate(1, {});
+    ASSERT(vm.heap.store(object, 0, rvm::Object{rvm::ObjectKind::Bool, false}));
+    auto status = vm.run_for(5 + 4 * 9);
+    ASSERT(status.kind == rvm::StatusKind::BudgetExhausted);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(10)}));
+
+    auto blob = vm.snapshot();
+    ASSERT(blob.size() == 40 + 3 * sizeof(rvm::Object));
+    // The padding after the kind of every value is zeroed
+    for (rvm::u64 i = 40; i < blob.size(); i += sizeof(rvm::Object)) {
+        ASSERT(std::all_of(blob.begin() + i + 1, blob.begin() + i + 8, [](rvm::u8 byte) { return byte == 0; }));
+    }
+
+    rvm::VM clone = vm.clone();
+    ASSERT(&*clone.program == &*vm.program);
+    // The heap is only copied by the first write
+    ASSERT(clone.heap.data() == vm.heap.data());
+    ASSERT(clone.heap.store(object, 0, rvm::Object{rvm::ObjectKind::Bool, true}));
+    ASSERT(clone.heap.data() != vm.heap.data());
+    ASSERT(vm.heap.load(object, 0).same(rvm::Object{rvm::ObjectKind::Bool, false}));
+    clone.run_for(4);
+    ASSERT(clone.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(11)}));
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(10)}));
+
+    rvm::Error *error = nullptr;
+    clone.restore(blob, &error);
+    HANDLE_ERROR(error, "failed to restore the snapshot: ");
+    ASSERT(clone.pc == vm.pc);
+    ASSERT(clone.stack.size() == 1);
+    ASSERT(clone.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(10)}));
+    ASSERT(clone.heap.used() == 2);
+    ASSERT(clone.heap.contains(object));
+    ASSERT(clone.heap.load(object, 0).same(rvm::Object{rvm::ObjectKind::Bool, false}));
+
+    // A fresh VM continues exactly like the one the snapshot was taken from
+    rvm::VM restored{vm.program};
+    restored.restore(blob, &error);
+    HANDLE_ERROR(error, "failed to restore the snapshot: ");
+    restored.run_for(4 * 5);
+    vm.run_for(4 * 5);
+    ASSERT(restored.pc == vm.pc);
+    ASSERT(restored.stack.top()->same(*vm.stack.top()));
+
+    blob[40] = 0xff;
+    restored.restore(blob, &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidSnapshot);
+    ASSERT(restored.stack.top()->same(*vm.stack.top()));
+    delete error;
+    error = nullptr;
+
+    restored.restore(std::span<rvm::u8 const>(blob).first(41), &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidSnapshot);
+    delete error;
+    error = nullptr;
+
+    // The header of the heap object claims more values than there are
+    blob[40] = static_cast<rvm::u8>(rvm::ObjectKind::U64);
+    blob[40 + 16 + 8] = 2;
+    restored.restore(blob, &error);
+    ASSERT(error != nullptr);
+    ASSERT(error->kind == rvm::ErrorKind::InvalidSnapshot);
+    delete error;
+    error = nullptr;
+
+    // A runtime error leaves a stack the analysis does not expect at pc,
+    // which still has to restore and resume with the checked path
+    std::vector<rvm::Instruction> failing{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(5)} },
+    };
+    rvm::VM stopped{failing};
+    ASSERT(stopped.run().kind == rvm::StatusKind::Error);
+    rvm::VM resumed{stopped.program};
+    resumed.restore(stopped.snapshot(), &error);
+    HANDLE_ERROR(error, "failed to restore the snapshot after an error: ");
+    ASSERT(resumed.pc == stopped.pc);
+    ASSERT(resumed.run().kind == rvm::StatusKind::Halt);
+    ASSERT(resumed.stack.size() == 1);
+    ASSERT(resumed.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(5)}));
+    return 0;
+}
+
+int heap_collection(Context *ctx) {
+    ctx->begin("heap_collection");
+    auto push = [](rvm::u64 value) {
+        return rvm::Instruction{rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, value}};
+    };
+    // a = [b, garbage], b = [5], then replaces the garbage forever
+    std::vector<rvm::Instruction> instructions{
+        push(2), rvm::InstructionKind::Alloc,
+        push(0), push(1), rvm::InstructionKind::Alloc,
+        push(0), push(5), rvm::InstructionKind::Store,
+        rvm::InstructionKind::Store,
+        push(1), push(100), rvm::InstructionKind::Alloc, rvm::InstructionKind::Store,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(9)} },
+    };
+
+    rvm::VM vm{instructions};
+    ASSERT(vm.program->stack_depth_known);
+    rvm::VM checked{instructions};
+    auto status = vm.run_for(100000);
+    ASSERT(status.kind == rvm::StatusKind::BudgetExhausted);
+    for (int i = 0; i < 100000; i++) {
+        status = checked.step();
+        ASSERT(status.ok());
+    }
+
+    for (auto *current : {&vm, &checked}) {
+        auto& heap = current->heap;
+        // Only the last garbage object survives a collection, so the heap
+        // never has to grow
+        ASSERT(heap.collections() > 0);
+        ASSERT(heap.capacity() == rvm::Heap::initial_capacity);
+        ASSERT(current->stack.size() >= 1);
+        auto a = current->stack[0];
+        ASSERT(heap.contains(a));
+        ASSERT(heap.size(a) == 2);
+        auto b = heap.load(a, 0);
+        ASSERT(heap.contains(b));
+        ASSERT(heap.load(b, 0).same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(5)}));
+        ASSERT(heap.contains(heap.load(a, 1)));
+        ASSERT(heap.size(heap.load(a, 1)) == 100);
+    }
+
+    // Collecting a shared heap only copies the live objects out of it and
+    // leaves the other copy alone
+    rvm::Heap shared{};
+    auto live = shared.allocate(1, {});
+    shared.allocate(100, {});
+    ASSERT(shared.store(live, 0, rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)}));
+    rvm::Heap copy = shared;
+    rvm::Object roots[] = {live, live};
+    ASSERT(copy.collect(roots));
+    ASSERT(copy.used() == 2);
+    ASSERT(roots[0].same(roots[1]));
+    ASSERT(copy.load(roots[0], 0).same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)}));
+    ASSERT(copy.data() != shared.data());
+    ASSERT(shared.used() == 103);
+    ASSERT(shared.size(live) == 1);
+    ASSERT(shared.load(live, 0).same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(7)}));
+
+    // Load keeps the pointer, the value is pushed on top of it
+    rvm::VM load{std::vector<rvm::Instruction>{push(1), rvm::InstructionKind::Alloc, push(0), rvm::InstructionKind::Load}};
+    status = load.run();
+    ASSERT(status.kind == rvm::StatusKind::Halt);
+    ASSERT(load.stack.size() == 2);
+    ASSERT(load.stack[0].kind == rvm::ObjectKind::Pointer);
+    ASSERT(load.stack[1].same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)}));
+
+    // The register and native code execute heap instructions with step and
+    // continue after them
+    std::vector<rvm::Instruction> store_load{
+        push(2), rvm::InstructionKind::Alloc,
+        push(0), push(40), rvm::InstructionKind::Store,
+        push(0), rvm::InstructionKind::Load,
+        push(2), rvm::InstructionKind::Add,
+    };
+    rvm::Program compiled{store_load};
+    compiled.edit().compile();
+    rvm::VM native{compiled};
+    rvm::VM registers{store_load};
+    registers.select(rvm::Engine::Register);
+    ASSERT(registers.program->registers != nullptr);
+    for (auto *engine : {&native, &registers}) {
+        status = engine->run();
+        ASSERT(status.kind == rvm::StatusKind::Halt);
+        ASSERT(engine->stack.size() == 2);
+        ASSERT(engine->heap.contains(engine->stack[0]));
+        ASSERT(engine->stack[1].same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(42)}));
+    }
+
+    rvm::VM out_of_bounds{std::vector<rvm::Instruction>{push(1), rvm::InstructionKind::Alloc, push(1), rvm::InstructionKind::Load}};
+    status = out_of_bounds.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::OutOfBounds);
+    ASSERT(status.pc == 3);
+
+    // Pointers which were not allocated are never followed
+    rvm::VM forged{std::vector<rvm::Instruction>{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Pointer, static_cast<rvm::u64>(7)} },
+        push(0), rvm::InstructionKind::Load,
+    }};
+    status = forged.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::InvalidPointer);
+
+    rvm::VM too_large{std::vector<rvm::Instruction>{push(rvm::Heap::max_object_size + 1), rvm::InstructionKind::Alloc}};
+    status = too_large.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::OutOfMemory);
+
+    // Accepted as a size, but far beyond the limit of the heap
+    rvm::VM over_limit{std::vector<rvm::Instruction>{push(rvm::Heap::max_object_size - 1), rvm::InstructionKind::Alloc}};
+    status = over_limit.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::OutOfMemory);
+    ASSERT(over_limit.heap.capacity() == 0);
+
+    rvm::VM limited{std::vector<rvm::Instruction>{push(10), rvm::InstructionKind::Alloc, push(10000), rvm::InstructionKind::Alloc}};
+    limited.heap.limit = 64 * 1024;
+    status = limited.step();
+    ASSERT(status.ok());
+    status = limited.run();
+    ASSERT(status.kind == rvm::StatusKind::Error);
+    ASSERT(status.error == rvm::ErrorKind::OutOfMemory);
+    ASSERT(status.pc == 3);
+    // The first object survived the failed allocation
+    ASSERT(limited.heap.contains(limited.stack[0]));
+    ASSERT(limited.heap.size(limited.stack[0]) == 10);
+    return 0;
+}
+
+int object_arena(Context *ctx) {
+    ctx->begin("object_arena");
+    std::vector<rvm::Instruction> instructions{};
+    for (rvm::u64 i = 0; i < 1000; i++) {
+        instructions.push_back({ rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, i} });
+        instructions.push_back(rvm::InstructionKind::Nop);
+    }
+
+    FILE *file = tmpfile();
+    if (!file) {
+        ctx->fail(std::format("could not open file because {}", strerror(errno)));
+        return 2;
+    }
+    defer(fclose(file));
+
+    rvm::Error *error = nullptr;
+    for (auto& instruction : instructions) {
+        instruction.write(file, &error);
+        HANDLE_ERROR(error, "Failed to write instruction: ");
+    }
+
+    std::optional<rvm::Instruction> copy{};
+    {
+        rvm::ObjectArena arena{};
+        fseek(file, 0, SEEK_SET);
+        auto bytecode = rvm::bytecode_from_file(file, arena, &error);
+        HANDLE_ERROR(error, "error while parsing bytecode: ");
+        ASSERT(bytecode == instructions);
+        ASSERT(arena.size() == 1000);
+        ASSERT(bytecode[0].borrowed);
+        ASSERT(!bytecode[1].borrowed);
+
+        // Copies own their operand, so they outlive the arena
+        copy = bytecode[2];
+        ASSERT(!copy->borrowed);
+
+        // Containers decode into the arena as well
+        FILE *container = tmpfile();
+        ASSERT(container != nullptr);
+        defer(fclose(container));
+        rvm::write_bytecode(container, instructions, &error);
+        HANDLE_ERROR(error, "failed to write container: ");
+        fseek(container, 0, SEEK_SET);
+        auto decoded = rvm::bytecode_from_file(container, arena, &error);
+        HANDLE_ERROR(error, "error while parsing container: ");
+        ASSERT(decoded == instructions);
+        ASSERT(arena.size() == 2000);
+    }
+    ASSERT(copy->same(instructions[2]));
+    return 0;
+}
+
+// Only checks anything when built with RVM_PROFILE
+int profile_counts(Context *ctx) {
+    ctx->begin("profile_counts");
+#if RVM_PROFILE
+    // Adds 1 to the counter forever
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+
+    rvm::VM vm{instructions};
+    vm.run_for(5 + 4 * 999);
+    ASSERT(vm.stack.top()->same(rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1000)}));
+
+    // Push 0; Push 1 is fused on the first pass, so the Push 1; Add at 1
+    // is only dispatched by the 999 jumps back to it
+    auto const& profile = vm.profile;
+    ASSERT(profile.pc_counts[0] == 1);
+    ASSERT(profile.pc_counts[1] == 999);
+    ASSERT(profile.pc_counts[4] == 1000);
+    ASSERT(profile.kind_counts[static_cast<size_t>(rvm::InstructionKind::PushPush)] == 1);
+    ASSERT(profile.kind_counts[static_cast<size_t>(rvm::InstructionKind::PushAdd)] == 999);
+    ASSERT(profile.kind_counts[static_cast<size_t>(rvm::InstructionKind::JmpIf)] == 1000);
+
+    rvm::u64 samples = 0;
+    for (auto count : profile.kind_samples) {
+        samples += count;
+    }
+    ASSERT(samples > 0);
+    ASSERT(samples <= 3 * 1000 / rvm::Profile::sample_period + 1);
+
+    FILE *file = tmpfile();
+    ASSERT(file != nullptr);
+    defer(fclose(file));
+    profile.write_csv(file, *vm.program);
+    rewind(file);
+    char line[128];
+    ASSERT(fgets(line, sizeof line, file) != nullptr);
+    ASSERT(std::string_view(line) == "scope,name,pc,count,samples,ticks\n");
+#endif
+    return 0;
+}
+
+// Only checks anything when built with RVM_PROFILE on Linux
+int perf_sampler(Context *ctx) {
+    ctx->begin("perf_sampler");
+#if RVM_PROFILE && defined(__linux__)
+    // Adds 1 to the counter forever
+    std::vector<rvm::Instruction> instructions{
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(0)} },
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+        rvm::InstructionKind::Add,
+        { rvm::InstructionKind::Push, new rvm::Object{rvm::ObjectKind::Bool, true} },
+        { rvm::InstructionKind::JmpIf, new rvm::Object{rvm::ObjectKind::U64, static_cast<rvm::u64>(1)} },
+    };
+    rvm::VM vm{instructions};
+
+    rvm::Error *error = nullptr;
+    rvm::PerfSampler sampler{};
+    sampler.start(vm, &error);
+    if (error != nullptr) {
+        // perf_event_open is not allowed everywhere, containers often
+        // forbid it
+        ASSERT(error->kind == rvm::ErrorKind::ProfilerUnavailable);
+        delete error;
+        return 0;
+    }
+    vm.run_for(20000000);
+    sampler.stop();
+
+    ASSERT(!sampler.events().empty());
+    rvm::u64 samples = 0;
+    for (auto event : sampler.events()) {
+        auto const& counts = sampler.samples(event);
+        ASSERT(counts.size() == instructions.size() + 1);
+        // Only the loop runs long enough to be sampled
+        for (rvm::u64 pc = 0; pc < counts.size(); pc++) {
+            ASSERT(counts[pc] == 0 || (pc >= 1 && pc <= 4));
+            samples += counts[pc];
+        }
+    }
+    ASSERT(samples > 0);
+
+    FILE *file = tmpfile();
+    ASSERT(file != nullptr);
+    defer(fclose(file));
+    sampler.write_folded(file, *vm.program);
+    rewind(file);
+    char line[128];
+    ASSERT(fgets(line, sizeof line, file) != nullptr);
+    ASSERT(std::string_view(line).find(';') != std::string_view::npos);
+#endif
+    return 0;
+}
+
+int generated_programs(Context *ctx) {
+    ctx->begin("generated_programs");
+    for (rvm::u64 seed = 1; seed <= 20; seed++) {
+        rvm::GenerateOptions options{};
+        options.seed = seed;
+        options.size = 2000;
+        options.branch_density = 0.2;
+        options.dynamic_jumps = seed % 2 == 0 ? 0.3 : 0;
+        options.max_stack_depth = 2 + seed;
+        options.constants = seed;
+
+        auto bytecode = rvm::generate(options);
+        ASSERT(bytecode.size() == options.size);
+        ASSERT(rvm::generate(options) == bytecode);
+
+        rvm::VM vm{bytecode};
+        ASSERT(vm.program->verified);
+        // Without dynamic jumps the stack depth is known everywhere
+        ASSERT(vm.program->stack_depth_known == (options.dynamic_jumps == 0));
+        ASSERT(vm.program->max_stack_depth <= options.max_stack_depth);
+
+        // Every jump goes forward, so the program ends within its size
+        auto status = vm.run_for(options.size);
+        ASSERT(status.kind == rvm::StatusKind::Halt);
+        ASSERT(vm.stack.size() >= 1);
+        ASSERT(vm.stack[0].kind == rvm::ObjectKind::U64);
+    }
+    return 0;
+}
+
 std::jmp_buf signal_jmp_buf;
 
 volatile std::sig_atomic_t signal_status = 0;
@@ -153,6 +1295,25 @@ int main() {
     std::vector<std::function<int(Context*)>> tests{
         parse_bytecode_correctly,
         add_2_values,
+        verify_jump_targets,
+        stack_depth_analysis,
+        run_until_halt,
+        container_round_trip,
+        varint_round_trip,
+        optimize_peephole,
+        superinstructions,
+        jit_matches_interpreter,
+        register_engine,
+        control_flow_graph,
+        fuel_metering,
+        scheduler,
+        shared_program,
+        snapshot_restore,
+        heap_collection,
+        object_arena,
+        profile_counts,
+        perf_sampler,
+        generated_programs,
     };
 
     for(size_t i = 0; i < tests.size(); i++) {